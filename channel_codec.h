@@ -0,0 +1,950 @@
+#ifndef CHANNEL_CODEC_H
+#define CHANNEL_CODEC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <queue>
+#include <vector>
+#include <stack>
+#include <utility>
+#include <tuple>
+#include <algorithm>
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned int DWORD;
+typedef unsigned int LONG;
+
+#pragma pack(push, 1)
+struct bfh {
+    WORD bfType; //specifies the file type
+    DWORD bfSize; //specifies the size in bytes of the bitmap file
+    WORD bfReserved1; //reserved; must be 0
+    WORD bfReserved2; //reserved; must be 0
+    DWORD bfOffBits; //species the offset in bytes from the bitmapfileheader to the bitmap bits
+};
+
+struct bih {
+    DWORD biSize; //specifies the number of bytes required by the struct
+    LONG biWidth; //specifies width in pixels
+    LONG biHeight; //species height in pixels
+    WORD biPlanes; //specifies the number of color planes, must be 1
+    WORD biBitCount; //specifies the number of bit per pixel
+    DWORD biCompression;//spcifies the type of compression
+    DWORD biSizeImage; //size of image in bytes
+    LONG biXPelsPerMeter; //number of pixels per meter in x axis
+    LONG biYPelsPerMeter; //number of pixels per meter in y axis
+    DWORD biClrUsed; //number of colors used by the bitmap
+    DWORD biClrImportant; //number of colors that are important
+};
+
+// channels are stored red, green, blue, then alpha; with 3 channels this is the original layout
+template <int CHANNELS>
+struct compressed_image_header {
+    LONG width;
+    LONG height;
+    LONG quality;
+    LONG tree_size[CHANNELS]; //tree nodes for 24 bit images, coded symbols for the other formats
+    LONG bitdata_size[CHANNELS];
+};
+
+struct compressed_sequence_header {
+    LONG frame_count;
+    LONG width;
+    LONG height;
+    LONG quality;
+    LONG block_size; //width and height of the blocks flagged as changed in delta frames
+};
+
+template <int CHANNELS>
+struct compressed_frame_header {
+    LONG frame_type; //0 for keyframes, 1 for frames stored as residuals against the previous frame
+    LONG changed_blocks; //number of blocks flagged as changed, delta frames only, checked against the flags
+    LONG reused_tables; //one bit per channel, set when the previous frame's tree is reused
+    LONG tree_size[CHANNELS];
+    LONG bitdata_size[CHANNELS];
+};
+#pragma pack(pop)
+
+#define BI_RGB 0
+#define BI_BITFIELDS 3
+
+#define SEQUENCE_BLOCK_SIZE 8
+#define KEYFRAME 0
+#define DELTAFRAME 1
+
+struct htn {
+    int value, freq;
+    htn *left = nullptr;
+    htn *right = nullptr;
+    int index;
+    int il = -1;
+    int ir = -1;
+
+    htn(){
+        value = 0;
+        left = NULL;
+        right = NULL;
+        il = -1;
+        ir = -1;
+    }
+
+    htn(int v, int f, htn *l, htn *r) {
+        value = v;
+        freq = f;
+        left = l;
+        right = r;
+    }
+
+    bool is_leaf() const {
+        return il == -1 && ir == -1;
+    }
+
+    void assign_indices(int &i){
+        index = i;
+        i++;
+        if (left){
+            left->assign_indices(i);
+            il = left->index;
+        }
+        if (right){
+            right->assign_indices(i);
+            ir = right->index;
+        }
+    }
+
+    int count_children(htn *node){
+        if (node == NULL){
+            return 0;
+        }
+        return 1 + count_children(node->left) + count_children(node->right);
+    }
+
+    void write_to_array(std::vector<htn> &arr, htn *node){
+        if (node == NULL){
+            return;
+        }
+        arr[node->index] = *node;
+        arr[node->index].left = NULL;
+        arr[node->index].right = NULL;
+        write_to_array(arr, node->left);
+        write_to_array(arr, node->right);
+    }
+
+    void free_children(){
+        if (left){
+            left->free_children();
+            delete left;
+            left = NULL;
+        }
+        if (right){
+            right->free_children();
+            delete right;
+            right = NULL;
+        }
+    }
+};
+
+struct compare_htn {
+    bool operator()(htn *a, htn *b) const {
+        return a->freq > b->freq;
+    }
+};
+
+// writes bits most significant first, codes are shifted in whole through a 64 bit accumulator
+struct bitwriter {
+    std::vector<BYTE> &out;
+    uint64_t acc = 0;
+    int count = 0;
+
+    bitwriter(std::vector<BYTE> &o) : out(o) {}
+
+    void put(uint64_t code, int length){
+        acc = (acc << length) | code;
+        count += length;
+        while (count >= 8){
+            count -= 8;
+            out.push_back((BYTE)(acc >> count));
+        }
+    }
+
+    void flush(){
+        if (count > 0){
+            out.push_back((BYTE)(acc << (8 - count)));
+        }
+        acc = 0;
+        count = 0;
+    }
+};
+
+// reads bits most significant first, bits past the end of the data read as 0
+struct bitreader {
+    const BYTE *data;
+    size_t size;
+    size_t pos = 0;
+    uint64_t acc = 0; //unread bits, aligned to the top
+    int count = 0;
+
+    bitreader(const BYTE *d, size_t s) : data(d), size(s) {}
+
+    void refill(){
+        while (count <= 56){
+            uint64_t b = pos < size ? data[pos] : 0;
+            pos++;
+            acc |= b << (56 - count);
+            count += 8;
+        }
+    }
+
+    uint64_t peek(int n) const {
+        return acc >> (64 - n);
+    }
+
+    void skip(int n){
+        acc <<= n;
+        count -= n;
+    }
+
+    int getbit(){
+        if (count == 0){
+            refill();
+        }
+        int bit = (int)(acc >> 63);
+        skip(1);
+        return bit;
+    }
+};
+
+// bounds checked cursor over an in-memory compressed file
+struct byte_reader {
+    const BYTE *data;
+    size_t size;
+    size_t pos = 0;
+
+    byte_reader(const BYTE *d, size_t s) : data(d), size(s) {}
+
+    bool read(void *dst, size_t n){
+        if (n > size - pos){
+            return false;
+        }
+        memcpy(dst, data + pos, n);
+        pos += n;
+        return true;
+    }
+
+    const BYTE *take(size_t n){
+        if (n > size - pos){
+            return NULL;
+        }
+        const BYTE *p = data + pos;
+        pos += n;
+        return p;
+    }
+};
+
+inline void append_bytes(std::vector<BYTE> &out, const void *src, size_t n){
+    const BYTE *p = (const BYTE *)src;
+    out.insert(out.end(), p, p + n);
+}
+
+inline bool read_file(const char *path, std::vector<BYTE> &data){
+    FILE *file = fopen(path, "rb");
+    if (file == NULL){
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data.resize(size < 0 ? 0 : size);
+    size_t got = fread(data.data(), 1, data.size(), file);
+    fclose(file);
+    return got == data.size();
+}
+
+inline bool write_file(const char *path, const std::vector<BYTE> &data){
+    FILE *file = fopen(path, "wb");
+    if (file == NULL){
+        return false;
+    }
+    size_t put = fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+    return put == data.size();
+}
+
+// finds the headers and pixel rows of a bitmap file, returns false if the rows don't fit in the file
+inline bool parse_bitmap(const BYTE *data, size_t size, bfh &fileHeader, bih &infoHeader, const BYTE *&pixels){
+    if (size < sizeof(bfh) + sizeof(bih)){
+        return false;
+    }
+    memcpy(&fileHeader, data, sizeof(bfh));
+    memcpy(&infoHeader, data + sizeof(bfh), sizeof(bih));
+
+    // pixels are read as plain BGR(A), so bitfields are only accepted when their masks say exactly that
+    if (infoHeader.biCompression == BI_BITFIELDS){
+        DWORD masks[4] = {0, 0, 0, 0}; //red, green, blue, alpha
+        size_t mask_bytes = (infoHeader.biSize >= 56 ? 4 : 3) * sizeof(DWORD);
+        if (infoHeader.biBitCount != 32 || size < sizeof(bfh) + sizeof(bih) + mask_bytes){
+            return false;
+        }
+        memcpy(masks, data + sizeof(bfh) + sizeof(bih), mask_bytes);
+        if (masks[0] != 0x00FF0000 || masks[1] != 0x0000FF00 || masks[2] != 0x000000FF || (masks[3] != 0 && masks[3] != 0xFF000000)){
+            return false;
+        }
+    } else if (infoHeader.biCompression != BI_RGB){
+        return false;
+    }
+
+    // the codec indexes rows and columns with ints, and the row size times the height must not wrap
+    if (infoHeader.biWidth > INT_MAX || infoHeader.biHeight > INT_MAX){
+        return false;
+    }
+    size_t pixel_width = ((size_t)infoHeader.biWidth * infoHeader.biBitCount + 31) / 32 * 4;
+    if (pixel_width != 0 && infoHeader.biHeight > SIZE_MAX / pixel_width){
+        return false;
+    }
+    size_t pixel_bytes = pixel_width * infoHeader.biHeight;
+    if (fileHeader.bfOffBits > size || pixel_bytes > size - fileHeader.bfOffBits){
+        return false;
+    }
+    pixels = data + fileHeader.bfOffBits;
+    return true;
+}
+
+// decompressed pixel rows are plain BGR(A) right after the two headers, so the original's
+// extended header and colour masks are dropped and the headers are rewritten to match
+inline void rewrite_output_headers(bfh &fileHeader, bih &infoHeader, size_t pixel_bytes){
+    fileHeader.bfOffBits = sizeof(bfh) + sizeof(bih);
+    fileHeader.bfSize = sizeof(bfh) + sizeof(bih) + pixel_bytes;
+    infoHeader.biSize = sizeof(bih);
+    infoHeader.biCompression = BI_RGB;
+}
+
+// the original headers are written last in a compressed image
+inline bool peek_image_headers(const BYTE *data, size_t size, bfh &fileHeader, bih &infoHeader){
+    if (size < sizeof(bfh) + sizeof(bih)){
+        return false;
+    }
+    memcpy(&fileHeader, data + size - sizeof(bfh) - sizeof(bih), sizeof(bfh));
+    memcpy(&infoHeader, data + size - sizeof(bih), sizeof(bih));
+    return true;
+}
+
+// huffman coding of CHANNELS planes of SYMBOL sized values, every stage from histogram to bitstream
+// is specialized at compile time on the symbol width and channel count
+template <typename SYMBOL, int CHANNELS>
+struct channel_codec {
+    static constexpr int CHANNEL_COUNT = CHANNELS;
+    static constexpr int SYMBOL_BYTES = sizeof(SYMBOL);
+    static constexpr int ALPHABET = 1 << (8 * SYMBOL_BYTES);
+    static constexpr int PIXEL_BYTES = CHANNELS * SYMBOL_BYTES;
+    static constexpr int BIT_COUNT = 8 * PIXEL_BYTES;
+    static constexpr int LOOKUP_BITS = SYMBOL_BYTES == 1 ? 10 : 12; //prefix bits resolved by one decode table lookup
+    // 24 bit images keep the original flattened tree of 16 byte nodes, the formats added with this
+    // codec store only each coded symbol and its canonical code length, which for 16 bit channels
+    // is what keeps the trees from outweighing the bitstream
+    static constexpr bool NODE_TREES = SYMBOL_BYTES == 1 && CHANNELS == 3;
+    static constexpr int MAX_CODE_LENGTH = 63;
+
+    typedef compressed_image_header<CHANNELS> image_header;
+    typedef compressed_frame_header<CHANNELS> frame_header;
+    typedef std::vector<SYMBOL> plane;
+
+    struct lookup_entry {
+        int value; //decoded symbol, or the node to keep walking from
+        int length; //bits consumed
+        bool leaf;
+    };
+
+    struct huff_table {
+        std::vector<htn> arr; //flattened tree as written to file, root first
+        std::vector<uint64_t> codes; //code of each symbol, first bit most significant
+        std::vector<BYTE> lengths; //code length of each symbol
+        int longest = 0; //longest code length, picks how many bits encode stores at once
+        std::vector<bool> present; //whether a symbol has a code in this tree
+        std::vector<lookup_entry> lookup; //decoder table indexed by the next LOOKUP_BITS bits
+    };
+
+    // buffers kept by callers that compress many images, so repeated calls don't reallocate
+    struct workspace {
+        plane planes[CHANNELS];
+        huff_table tables[CHANNELS];
+        std::vector<BYTE> bitdata[CHANNELS];
+        std::vector<int> freq;
+    };
+
+    // calls f(std::integral_constant<int, c>) for every channel, unrolled by the compiler
+    template <typename F, int... C>
+    static void unroll(F &&f, std::integer_sequence<int, C...>){
+        (f(std::integral_constant<int, C>()), ...);
+    }
+
+    template <typename F>
+    static void for_each_channel(F &&f){
+        unroll(f, std::make_integer_sequence<int, CHANNELS>());
+    }
+
+    // byte offset of a channel inside a pixel, bitmaps store blue, green, red, alpha
+    static constexpr int channel_offset(int c){
+        return (CHANNELS >= 3 && c < 3 ? 2 - c : c) * SYMBOL_BYTES;
+    }
+
+    static size_t row_bytes(size_t width){
+        size_t pixel_width = width * PIXEL_BYTES;
+        if (pixel_width % 4 != 0){
+            pixel_width += 4 - (pixel_width % 4);
+        }
+        return pixel_width;
+    }
+
+    // splits padded bitmap rows into one quantized plane per channel
+    static void split(const BYTE *pixels, int width, int height, int quality_factor, plane *planes){
+        size_t pixel_width = row_bytes(width);
+        for (int c = 0; c < CHANNELS; c++){
+            planes[c].resize((size_t)width * height);
+        }
+
+        // dividing by quality_factor as a multiply: exact for 16 bit values and divisors below 2^16
+        uint64_t reciprocal = (((uint64_t)1 << 32) / quality_factor) + 1;
+        for (int row = 0; row < height; row++){
+            const BYTE *src = pixels + (size_t)row * pixel_width;
+            size_t base = (size_t)row * width;
+            for (int col = 0; col < width; col++){
+                for_each_channel([&](auto c){
+                    SYMBOL v;
+                    memcpy(&v, src + col * PIXEL_BYTES + channel_offset(c), SYMBOL_BYTES);
+                    planes[c][base + col] = (v * reciprocal) >> 32;
+                });
+            }
+        }
+    }
+
+    // restores quality scaling and interleaves the planes back into padded bitmap rows
+    static void merge(const plane *planes, int width, int height, int quality_factor, BYTE *pixels){
+        size_t pixel_width = row_bytes(width);
+        for (int row = 0; row < height; row++){
+            BYTE *dst = pixels + (size_t)row * pixel_width;
+            size_t base = (size_t)row * width;
+            memset(dst + width * PIXEL_BYTES, 0, pixel_width - width * PIXEL_BYTES);
+            for (int col = 0; col < width; col++){
+                for_each_channel([&](auto c){
+                    SYMBOL v = planes[c][base + col] * quality_factor;
+                    memcpy(dst + col * PIXEL_BYTES + channel_offset(c), &v, SYMBOL_BYTES);
+                });
+            }
+        }
+    }
+
+    static void histogram(const SYMBOL *symbols, size_t count, std::vector<int> &freq){
+        freq.assign(ALPHABET, 0);
+        size_t i = 0;
+
+        // runs of equal bytes would make every increment wait on the previous one, so 8 bit
+        // symbols are spread over four tables that are summed at the end
+        if constexpr (ALPHABET <= 256){
+            int partial[3][ALPHABET] = {};
+            for (; i + 4 <= count; i += 4){
+                freq[symbols[i]]++;
+                partial[0][symbols[i + 1]]++;
+                partial[1][symbols[i + 2]]++;
+                partial[2][symbols[i + 3]]++;
+            }
+            for (int v = 0; v < ALPHABET; v++){
+                freq[v] += partial[0][v] + partial[1][v] + partial[2][v];
+            }
+        }
+        for (; i < count; i++){
+            freq[symbols[i]]++;
+        }
+    }
+
+    // builds a huffman table from symbol frequencies, unused symbols get no code
+    static void build_table(const std::vector<int> &freq, huff_table &table){
+        std::priority_queue<htn *, std::vector<htn *>, compare_htn> queue;
+        for (int i = 0; i < ALPHABET; i++){
+            if (freq[i] != 0){
+                queue.push(new htn(i, freq[i], NULL, NULL));
+            }
+        }
+        while (queue.size() > 1){
+            htn *left = queue.top();
+            queue.pop();
+            htn *right = queue.top();
+            queue.pop();
+            queue.push(new htn(-1, left->freq + right->freq, left, right));
+        }
+
+        table.arr.clear();
+        if (!queue.empty()){
+            htn *root = queue.top();
+            int i = 0;
+            root->assign_indices(i);
+            table.arr.resize(i);
+            root->write_to_array(table.arr, root);
+            root->free_children();
+            delete root;
+        }
+        assign_codes(table);
+        if (!NODE_TREES && !table.arr.empty()){
+            canonicalize(table);
+        }
+    }
+
+    // gives codes in canonical order, shorter codes first and by symbol within a length, then rebuilds
+    // the tree from them, so the code lengths alone describe the table
+    static void canonicalize(huff_table &table){
+        std::vector<int> symbols;
+        for (int v = 0; v < ALPHABET; v++){
+            if (table.present[v]){
+                symbols.push_back(v);
+            }
+        }
+        std::stable_sort(symbols.begin(), symbols.end(), [&](int a, int b){
+            return table.lengths[a] < table.lengths[b];
+        });
+
+        table.arr.assign(1, htn());
+        table.longest = table.lengths[symbols.back()];
+        if (symbols.size() == 1){
+            table.arr[0].value = symbols[0];
+            table.codes[symbols[0]] = 0;
+            return;
+        }
+        uint64_t code = 0;
+        int length = table.lengths[symbols[0]];
+        for (size_t i = 0; i < symbols.size(); i++){
+            int v = symbols[i];
+            code <<= table.lengths[v] - length;
+            length = table.lengths[v];
+            table.codes[v] = code;
+
+            // walks down from the root, adding the nodes this code passes through
+            int node = 0;
+            for (int b = length - 1; b >= 0; b--){
+                bool right = (code >> b) & 1;
+                int child = right ? table.arr[node].ir : table.arr[node].il;
+                if (child == -1){
+                    child = table.arr.size();
+                    table.arr.push_back(htn());
+                    (right ? table.arr[node].ir : table.arr[node].il) = child;
+                }
+                node = child;
+            }
+            table.arr[node].value = v;
+            code++;
+        }
+    }
+
+    // walks the flattened tree to give each leaf its code, a single leaf gets an empty code
+    static void assign_codes(huff_table &table){
+        table.codes.assign(ALPHABET, 0);
+        table.lengths.assign(ALPHABET, 0);
+        table.longest = 0;
+        table.present.assign(ALPHABET, false);
+        if (table.arr.empty()){
+            return;
+        }
+
+        // frequencies are ints, so the tree is less than 64 levels deep and every code fits in 64 bits
+        std::stack<std::pair<int, std::pair<uint64_t, int> >, std::vector<std::pair<int, std::pair<uint64_t, int> > > > s;
+        s.push(std::make_pair(0, std::make_pair((uint64_t)0, 0)));
+        while (!s.empty()){
+            auto [node, code] = s.top();
+            s.pop();
+            htn &n = table.arr[node];
+            if (n.is_leaf()){
+                table.codes[n.value] = code.first;
+                table.lengths[n.value] = code.second;
+                table.longest = std::max(table.longest, code.second);
+                table.present[n.value] = true;
+                continue;
+            }
+            if (n.ir != -1){
+                s.push(std::make_pair(n.ir, std::make_pair((code.first << 1) | 1, code.second + 1)));
+            }
+            if (n.il != -1){
+                s.push(std::make_pair(n.il, std::make_pair(code.first << 1, code.second + 1)));
+            }
+        }
+    }
+
+    // fills the decode table: each LOOKUP_BITS prefix resolves to a symbol or to the node reached after it
+    static void build_lookup(huff_table &table){
+        table.lookup.resize(1 << LOOKUP_BITS);
+        for (int p = 0; p < (1 << LOOKUP_BITS); p++){
+            int node = 0;
+            int length = 0;
+            while (!table.arr[node].is_leaf() && length < LOOKUP_BITS){
+                int bit = (p >> (LOOKUP_BITS - 1 - length)) & 1;
+                node = bit ? table.arr[node].ir : table.arr[node].il;
+                length++;
+            }
+            lookup_entry &e = table.lookup[p];
+            e.leaf = table.arr[node].is_leaf();
+            e.value = e.leaf ? table.arr[node].value : node;
+            e.length = length;
+        }
+    }
+
+    // number of bits needed to encode the frequencies with a table, -1 if a symbol has no code
+    static long long table_cost(const std::vector<int> &freq, const huff_table &table){
+        long long bits = 0;
+        for (int i = 0; i < ALPHABET; i++){
+            if (freq[i] == 0){
+                continue;
+            }
+            if (table.present.empty() || !table.present[i]){
+                return -1;
+            }
+            bits += (long long)freq[i] * table.lengths[i];
+        }
+        return bits;
+    }
+
+    // entries of a written tree, the tree_size stored in headers
+    static int tree_size(const huff_table &table){
+        if (NODE_TREES || table.arr.empty()){
+            return table.arr.size();
+        }
+        int used = 0;
+        for (int v = 0; v < ALPHABET; v++){
+            used += table.present[v];
+        }
+        return used;
+    }
+
+    // size of a written tree in the file, in bits
+    static long long tree_cost(const huff_table &table){
+        if (NODE_TREES){
+            return (long long)table.arr.size() * 4 * sizeof(int) * 8;
+        }
+        std::vector<BYTE> out;
+        write_tree(table, out);
+        return (long long)out.size() * 8;
+    }
+
+    // fewest bits any tree coding used symbols can take: 2 * used - 1 nodes, or a gap and a length byte per symbol
+    static long long min_tree_cost(long long used){
+        if (NODE_TREES){
+            return (2 * used - 1) * 4 * sizeof(int) * 8;
+        }
+        return used * 2 * 8;
+    }
+
+    // shannon entropy of the frequencies in bits, no huffman code can do better
+    static double entropy_bits(const std::vector<int> &freq){
+        long long total = 0;
+        for (int i = 0; i < ALPHABET; i++){
+            total += freq[i];
+        }
+        double bits = 0;
+        for (int i = 0; i < ALPHABET; i++){
+            if (freq[i] != 0){
+                bits += freq[i] * log2((double)total / freq[i]);
+            }
+        }
+        return bits;
+    }
+
+    // canonical tables are written as each coded symbol, as its gap from the previous one in
+    // 7 bit groups, followed by its code length
+    static void write_tree(const huff_table &table, std::vector<BYTE> &out){
+        if (!NODE_TREES){
+            if (table.arr.empty()){
+                return;
+            }
+            int previous = -1;
+            for (int v = 0; v < ALPHABET; v++){
+                if (!table.present[v]){
+                    continue;
+                }
+                unsigned gap = v - previous - 1;
+                while (gap >= 0x80){
+                    out.push_back((BYTE)(gap | 0x80));
+                    gap >>= 7;
+                }
+                out.push_back((BYTE)gap);
+                out.push_back(table.lengths[v]);
+                previous = v;
+            }
+            return;
+        }
+        for (size_t i = 0; i < table.arr.size(); i++){
+            append_bytes(out, &table.arr[i].value, sizeof(int));
+            append_bytes(out, &table.arr[i].freq, sizeof(int));
+            append_bytes(out, &table.arr[i].il, sizeof(int));
+            append_bytes(out, &table.arr[i].ir, sizeof(int));
+        }
+    }
+
+    // reads canonical code lengths, rejecting symbols out of range or out of order and lengths
+    // that don't make a complete prefix code
+    static bool read_lengths(byte_reader &in, int size, huff_table &table){
+        if (size < 0 || size > ALPHABET || (size_t)size > (in.size - in.pos) / 2){
+            return false;
+        }
+        table.codes.assign(ALPHABET, 0);
+        table.lengths.assign(ALPHABET, 0);
+        table.present.assign(ALPHABET, false);
+        table.arr.clear();
+        table.longest = 0;
+        uint64_t kraft = 0;
+        int symbol = -1;
+        for (int i = 0; i < size; i++){
+            unsigned gap = 0;
+            BYTE b = 0x80;
+            for (int shift = 0; b & 0x80; shift += 7){
+                if (shift > 14 || !in.read(&b, 1)){
+                    return false;
+                }
+                gap |= (unsigned)(b & 0x7F) << shift;
+            }
+            BYTE length;
+            if (gap >= (unsigned)ALPHABET || !in.read(&length, 1)){
+                return false;
+            }
+            symbol += gap + 1;
+            if (symbol >= ALPHABET || (size == 1 ? length != 0 : length < 1 || length > MAX_CODE_LENGTH)){
+                return false;
+            }
+            table.present[symbol] = true;
+            table.lengths[symbol] = length;
+            if (size > 1){
+                kraft += (uint64_t)1 << (MAX_CODE_LENGTH - length);
+                if (kraft > (uint64_t)1 << MAX_CODE_LENGTH){
+                    return false;
+                }
+            }
+        }
+        if (size > 1 && kraft != (uint64_t)1 << MAX_CODE_LENGTH){
+            return false;
+        }
+        if (size > 0){
+            canonicalize(table);
+            build_lookup(table);
+        }
+        return true;
+    }
+
+    // reads a flattened tree, rejecting trees whose children don't follow their parent or whose leaves are out of range
+    static bool read_tree(byte_reader &in, int size, huff_table &table){
+        if (!NODE_TREES){
+            return read_lengths(in, size, table);
+        }
+        if (size < 0 || (size_t)size > (in.size - in.pos) / (4 * sizeof(int))){
+            return false;
+        }
+        table.arr.assign(size, htn());
+        for (int i = 0; i < size; i++){
+            htn &n = table.arr[i];
+            in.read(&n.value, sizeof(int));
+            in.read(&n.freq, sizeof(int));
+            in.read(&n.il, sizeof(int));
+            in.read(&n.ir, sizeof(int));
+            if (n.is_leaf()){
+                if (n.value < 0 || n.value >= ALPHABET){
+                    return false;
+                }
+            } else if (n.il <= i || n.ir <= i || n.il >= size || n.ir >= size){
+                return false;
+            }
+        }
+        if (size > 0){
+            build_lookup(table);
+        }
+        return true;
+    }
+
+    // appends the codes of the symbols to out, returns the number of bits written
+    // bits is their exact total from table_cost, so the output is sized once and the loop only shifts and stores
+    static long long encode(const SYMBOL *symbols, size_t count, const huff_table &table, long long bits, std::vector<BYTE> &out){
+        size_t start = out.size();
+        out.resize(start + (bits + 7) / 8);
+        BYTE *dst = out.data() + start;
+        const uint64_t *codes = table.codes.data();
+        const BYTE *lengths = table.lengths.data();
+        uint64_t acc = 0;
+        int pending = 0;
+        if (table.longest <= 32){
+            // with codes of at most 32 bits, 32 pending bits can be stored at once without overflowing acc
+            for (size_t i = 0; i < count; i++){
+                acc = (acc << lengths[symbols[i]]) | codes[symbols[i]];
+                pending += lengths[symbols[i]];
+                if (pending >= 32){
+                    pending -= 32;
+                    uint32_t word = (uint32_t)(acc >> pending);
+                    dst[0] = (BYTE)(word >> 24);
+                    dst[1] = (BYTE)(word >> 16);
+                    dst[2] = (BYTE)(word >> 8);
+                    dst[3] = (BYTE)word;
+                    dst += 4;
+                }
+            }
+        } else {
+            for (size_t i = 0; i < count; i++){
+                acc = (acc << lengths[symbols[i]]) | codes[symbols[i]];
+                pending += lengths[symbols[i]];
+                while (pending >= 8){
+                    pending -= 8;
+                    *dst++ = (BYTE)(acc >> pending);
+                }
+            }
+        }
+        while (pending >= 8){
+            pending -= 8;
+            *dst++ = (BYTE)(acc >> pending);
+        }
+        long long written = (long long)(dst - (out.data() + start)) * 8 + pending;
+        if (pending > 0){
+            *dst++ = (BYTE)(acc << (8 - pending));
+        }
+        return written;
+    }
+
+    // decodes count symbols, resolving up to LOOKUP_BITS bits per table lookup before walking the tree
+    static void decode(const BYTE *data, size_t size, const huff_table &table, size_t count, SYMBOL *symbols){
+        if (count == 0){
+            return;
+        }
+        if (table.arr[0].is_leaf()){
+            std::fill(symbols, symbols + count, (SYMBOL)table.arr[0].value);
+            return;
+        }
+
+        bitreader bits(data, size);
+        for (size_t i = 0; i < count; i++){
+            bits.refill();
+            const lookup_entry &e = table.lookup[bits.peek(LOOKUP_BITS)];
+            bits.skip(e.length);
+            if (e.leaf){
+                symbols[i] = e.value;
+                continue;
+            }
+            int node = e.value;
+            while (!table.arr[node].is_leaf()){
+                node = bits.getbit() ? table.arr[node].ir : table.arr[node].il;
+            }
+            symbols[i] = table.arr[node].value;
+        }
+    }
+
+    // compresses the pixel data of a bitmap: header, trees, bitarrays, then the original headers
+    static void compress(const bfh &fileHeader, const bih &infoHeader, const BYTE *pixels, int quality, std::vector<BYTE> &out){
+        workspace ws;
+        compress(fileHeader, infoHeader, pixels, quality, out, ws);
+    }
+
+    static void compress(const bfh &fileHeader, const bih &infoHeader, const BYTE *pixels, int quality, std::vector<BYTE> &out, workspace &ws){
+        int width = infoHeader.biWidth;
+        int height = infoHeader.biHeight;
+        int quality_factor = quality * 10;
+
+        plane *planes = ws.planes;
+        split(pixels, width, height, quality_factor, planes);
+
+        image_header header;
+        header.width = width;
+        header.height = height;
+        header.quality = quality;
+
+        huff_table *tables = ws.tables;
+        std::vector<BYTE> *bitdata = ws.bitdata;
+        std::vector<int> &freq = ws.freq;
+        for (int c = 0; c < CHANNELS; c++){
+            histogram(planes[c].data(), planes[c].size(), freq);
+            build_table(freq, tables[c]);
+            bitdata[c].clear();
+            header.tree_size[c] = tree_size(tables[c]);
+            header.bitdata_size[c] = encode(planes[c].data(), planes[c].size(), tables[c], table_cost(freq, tables[c]), bitdata[c]);
+        }
+
+        append_bytes(out, &header, sizeof(image_header));
+        for (int c = 0; c < CHANNELS; c++){
+            write_tree(tables[c], out);
+        }
+        for (int c = 0; c < CHANNELS; c++){
+            out.insert(out.end(), bitdata[c].begin(), bitdata[c].end());
+        }
+        append_bytes(out, &fileHeader, sizeof(bfh));
+        append_bytes(out, &infoHeader, sizeof(bih));
+    }
+
+    // rebuilds a bitmap file from a compressed image, returns false if the data is malformed
+    static bool decompress(const BYTE *data, size_t size, std::vector<BYTE> &out){
+        workspace ws;
+        return decompress(data, size, out, ws);
+    }
+
+    static bool decompress(const BYTE *data, size_t size, std::vector<BYTE> &out, workspace &ws){
+        byte_reader in(data, size);
+        image_header header;
+        bfh fileHeader;
+        bih infoHeader;
+        if (!in.read(&header, sizeof(image_header)) || !peek_image_headers(data, size, fileHeader, infoHeader)){
+            return false;
+        }
+        if (header.width > INT_MAX || header.height > INT_MAX){
+            return false;
+        }
+
+        huff_table *tables = ws.tables;
+        for (int c = 0; c < CHANNELS; c++){
+            if (!read_tree(in, header.tree_size[c], tables[c])){
+                return false;
+            }
+        }
+
+        size_t count = (size_t)header.width * header.height;
+        plane *planes = ws.planes;
+        for (int c = 0; c < CHANNELS; c++){
+            size_t bytes = ((size_t)header.bitdata_size[c] + 7) / 8;
+            const BYTE *bitdata = in.take(bytes);
+            if (bitdata == NULL || (count > 0 && tables[c].arr.empty())){
+                return false;
+            }
+            // every value takes at least one bit unless the tree is a single leaf
+            if (tables[c].arr.size() > 1 && count > header.bitdata_size[c]){
+                return false;
+            }
+            planes[c].resize(count);
+            decode(bitdata, bytes, tables[c], count, planes[c].data());
+        }
+
+        size_t pixel_bytes = (size_t)row_bytes(header.width) * header.height;
+        rewrite_output_headers(fileHeader, infoHeader, pixel_bytes);
+        out.resize(sizeof(bfh) + sizeof(bih) + pixel_bytes);
+        memcpy(out.data(), &fileHeader, sizeof(bfh));
+        memcpy(out.data() + sizeof(bfh), &infoHeader, sizeof(bih));
+        merge(planes, header.width, header.height, header.quality * 10, out.data() + sizeof(bfh) + sizeof(bih));
+        return true;
+    }
+};
+
+// calls f with the codec matching a bitmap's bits per pixel, returns false for unsupported formats
+template <typename F>
+bool dispatch_codec(int bit_count, F &&f){
+    switch (bit_count){
+    case 24:
+        f(channel_codec<BYTE, 3>());
+        return true;
+    case 32:
+        f(channel_codec<BYTE, 4>());
+        return true;
+    case 48:
+        f(channel_codec<WORD, 3>());
+        return true;
+    case 64:
+        f(channel_codec<WORD, 4>());
+        return true;
+    }
+    return false;
+}
+
+// one workspace for each codec dispatch_codec can pick, found with std::get<codec::workspace>
+typedef std::tuple<channel_codec<BYTE, 3>::workspace, channel_codec<BYTE, 4>::workspace,
+                   channel_codec<WORD, 3>::workspace, channel_codec<WORD, 4>::workspace> codec_workspaces;
+
+#endif
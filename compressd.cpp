@@ -0,0 +1,688 @@
+#include <signal.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <deque>
+#include <new>
+#include <exception>
+#include <system_error>
+#include "compressd_protocol.h"
+
+#define MAX_BATCH 32 //requests a connection hands to the queue at once
+#define MAX_BATCH_BYTES (64u << 20) //payload bytes a connection hands to the queue at once
+#define MAX_BUFFERED_BYTES (1024u << 20) //payload and response bytes held by all connections together
+#define KEEP_PAYLOAD_BYTES (1u << 20) //larger payload and output buffers are freed once used
+#define MAX_SPARE_BUFFERS 64 //sent output buffers kept for workers to reuse
+#define KEEP_WORKSPACE_BYTES (64u << 20) //codec workspaces of one worker larger than this are freed after a job
+#define MAX_CONNECTIONS 256 //connections served at once, later ones wait in the listen backlog
+#define MAX_IN_FLIGHT 64 //requests of one connection queued or running before it stops reading
+#define MAX_OUTBOX_BYTES (16u << 20) //unsent response bytes of one connection before it stops reading
+#define CLIENT_TIMEOUT_SECONDS 10 //a client stalled this long in the middle of a request or response is dropped
+
+// payloads and responses are charged to one byte budget from the moment they are read or before
+// they are produced until they are sent, so memory stays bounded however many clients send.
+// Output buffers go from a worker to the outbox and, once sent, back to whichever worker needs one
+struct shared_buffers {
+    std::mutex lock;
+    std::condition_variable freed;
+    size_t budget = MAX_BUFFERED_BYTES;
+    std::vector<std::vector<BYTE>> spare;
+
+    // callers waiting on the budget must not hold jobs back from the queue
+    bool take(size_t bytes, bool wait){
+        std::unique_lock<std::mutex> guard(lock);
+        while (wait && budget < bytes){
+            freed.wait(guard);
+        }
+        if (budget < bytes){
+            return false;
+        }
+        budget -= bytes;
+        return true;
+    }
+
+    void give(size_t bytes){
+        if (bytes == 0){
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        budget += bytes;
+        freed.notify_all();
+    }
+
+    void recycle(std::vector<BYTE> &buffer){
+        if (buffer.capacity() > KEEP_PAYLOAD_BYTES){
+            std::vector<BYTE>().swap(buffer);
+            return;
+        }
+        buffer.clear();
+        std::lock_guard<std::mutex> guard(lock);
+        if (spare.size() < MAX_SPARE_BUFFERS){
+            spare.push_back(std::move(buffer));
+        }
+    }
+
+    // swaps an empty buffer for a spare one, left empty when none is spare
+    void refill(std::vector<BYTE> &buffer){
+        std::lock_guard<std::mutex> guard(lock);
+        if (!spare.empty()){
+            buffer.swap(spare.back());
+            spare.pop_back();
+        }
+    }
+};
+
+struct outgoing {
+    daemon_response response;
+    std::vector<BYTE> body;
+    size_t charged; //budget bytes returned once the body is sent
+};
+
+// workers leave responses in the outbox and move on, a writer thread per connection sends them
+// so a client that doesn't read only stalls its own connection
+struct connection {
+    int sock;
+    shared_buffers *buffers;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<outgoing> outbox;
+    size_t outbox_bytes = 0;
+    int in_flight = 0;
+    bool reading_done = false;
+    bool broken = false; //a send failed, later responses are dropped
+
+    connection(int s, shared_buffers *b) : sock(s), buffers(b) {}
+
+    ~connection(){
+        close(sock);
+    }
+
+    // takes the body without copying it, the worker gets a spare buffer in its place
+    void deliver(const daemon_response &response, std::vector<BYTE> &body, size_t charged){
+        std::unique_lock<std::mutex> guard(lock);
+        in_flight--;
+        bool dropped = broken;
+        if (!dropped){
+            outbox.emplace_back();
+            outbox.back().response = response;
+            outbox.back().body.swap(body);
+            outbox.back().charged = charged;
+            outbox_bytes += sizeof(daemon_response) + outbox.back().body.size();
+        }
+        changed.notify_all();
+        guard.unlock();
+        if (dropped){
+            buffers->give(charged);
+        }
+        if (body.capacity() == 0){
+            buffers->refill(body);
+        }
+    }
+};
+
+struct job {
+    std::shared_ptr<connection> conn;
+    daemon_request request;
+    std::vector<BYTE> payload; //keeps up to KEEP_PAYLOAD_BYTES of capacity when the job is recycled
+    size_t charged = 0; //payload bytes taken from the budget
+    int fd = -1;
+};
+
+// bounded queue between connections and workers, a full queue stops connections from reading
+// so clients are slowed down by their own socket buffers. Jobs come from a fixed pool
+struct job_queue {
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<job *> jobs;
+    size_t capacity;
+
+    std::mutex free_lock;
+    std::condition_variable freed;
+    std::vector<job *> free_jobs;
+    shared_buffers *buffers;
+
+    job_queue(size_t c, size_t pool, shared_buffers *b) : capacity(c), buffers(b) {
+        for (size_t i = 0; i < pool; i++){
+            free_jobs.push_back(new job());
+        }
+    }
+
+    void push(std::vector<job *> &batch){
+        std::unique_lock<std::mutex> guard(lock);
+        for (size_t i = 0; i < batch.size(); i++){
+            while (jobs.size() >= capacity){
+                not_empty.notify_all();
+                not_full.wait(guard);
+            }
+            jobs.push_back(batch[i]);
+        }
+        if (batch.size() == 1){
+            not_empty.notify_one();
+        } else {
+            not_empty.notify_all();
+        }
+    }
+
+    job *pop(){
+        std::unique_lock<std::mutex> guard(lock);
+        while (jobs.empty()){
+            not_empty.wait(guard);
+        }
+        job *j = jobs.front();
+        jobs.pop_front();
+        not_full.notify_one();
+        return j;
+    }
+
+    // callers waiting on the pool or the budget must not hold jobs back from the queue
+    job *acquire(bool wait){
+        std::unique_lock<std::mutex> guard(free_lock);
+        while (wait && free_jobs.empty()){
+            freed.wait(guard);
+        }
+        if (free_jobs.empty()){
+            return NULL;
+        }
+        job *j = free_jobs.back();
+        free_jobs.pop_back();
+        return j;
+    }
+
+    bool charge(job &j, size_t bytes, bool wait){
+        if (!buffers->take(bytes, wait)){
+            return false;
+        }
+        j.charged += bytes;
+        return true;
+    }
+
+    void release(job *j){
+        j->conn.reset();
+        if (j->fd >= 0){
+            close(j->fd);
+            j->fd = -1;
+        }
+        if (j->payload.capacity() > KEEP_PAYLOAD_BYTES){
+            std::vector<BYTE>().swap(j->payload);
+        }
+        buffers->give(j->charged);
+        j->charged = 0;
+        std::lock_guard<std::mutex> guard(free_lock);
+        free_jobs.push_back(j);
+        freed.notify_all();
+    }
+};
+
+// sizes a payload the job has been charged for, false when it can't be allocated
+bool size_payload(job &j, size_t size){
+    try {
+        if (size > j.payload.capacity()){
+            std::vector<BYTE>().swap(j.payload);
+            j.payload.reserve(size);
+        }
+        j.payload.resize(size);
+    } catch (std::bad_alloc &){
+        return false;
+    }
+    return true;
+}
+
+// reads one request without its payload, false when the client is gone or breaks the protocol
+bool read_request(int sock, daemon_request &request, int &fd){
+    fd = -1;
+    if (!recv_all(sock, &request, sizeof(daemon_request), &fd)){
+        if (fd >= 0){
+            close(fd);
+        }
+        return false;
+    }
+    if (request.flags & REQUEST_FD){
+        return fd >= 0;
+    }
+    if (fd >= 0){
+        close(fd);
+        fd = -1;
+    }
+    return request.size <= MAX_PAYLOAD;
+}
+
+// reads the inline payload of a request the job has been charged for
+bool read_payload(int sock, job &j){
+    return size_payload(j, j.request.size) && recv_all(sock, j.payload.data(), j.payload.size());
+}
+
+// reads a passed file from its start, false if it ends early
+bool pread_all(int fd, BYTE *buf, size_t n){
+    size_t got = 0;
+    while (got < n){
+        ssize_t r = pread(fd, buf + got, n - got, got);
+        if (r < 0 && errno == EINTR){
+            continue;
+        }
+        if (r <= 0){
+            return false;
+        }
+        got += r;
+    }
+    return true;
+}
+
+size_t pending_bytes(int sock){
+    int n = 0;
+    if (ioctl(sock, FIONREAD, &n) != 0 || n < 0){
+        return 0;
+    }
+    return n;
+}
+
+// waits for the next request without a timeout, false when the socket fails
+bool wait_readable(int sock){
+    struct pollfd p;
+    p.fd = sock;
+    p.events = POLLIN;
+    while (true){
+        int r = poll(&p, 1, -1);
+        if (r > 0){
+            return true;
+        }
+        if (r < 0 && errno != EINTR){
+            return false;
+        }
+    }
+}
+
+// sends responses until the reader is done and every request it read has been answered
+void write_responses(std::shared_ptr<connection> conn){
+    std::unique_lock<std::mutex> guard(conn->lock);
+    while (true){
+        while (conn->outbox.empty() && !(conn->reading_done && conn->in_flight == 0)){
+            conn->changed.wait(guard);
+        }
+        if (conn->outbox.empty()){
+            break;
+        }
+        outgoing message = std::move(conn->outbox.front());
+        conn->outbox.pop_front();
+        bool broken = conn->broken;
+        guard.unlock();
+
+        struct iovec iov[2];
+        iov[0].iov_base = &message.response;
+        iov[0].iov_len = sizeof(daemon_response);
+        iov[1].iov_base = message.body.data();
+        iov[1].iov_len = message.body.size();
+        bool sent = !broken && send_all(conn->sock, iov, 2);
+        size_t message_bytes = sizeof(daemon_response) + message.body.size();
+        conn->buffers->recycle(message.body);
+        conn->buffers->give(message.charged);
+
+        guard.lock();
+        conn->outbox_bytes -= message_bytes;
+        // shutting the socket down also ends the reader
+        if (!sent && !conn->broken){
+            conn->broken = true;
+            shutdown(conn->sock, SHUT_RDWR);
+        }
+        conn->changed.notify_all();
+    }
+}
+
+void hand_over(std::shared_ptr<connection> &conn, job_queue *queue, std::vector<job *> &batch, size_t &batch_bytes){
+    batch_bytes = 0;
+    if (batch.empty()){
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(conn->lock);
+        conn->in_flight += batch.size();
+    }
+    queue->push(batch);
+    batch.clear();
+}
+
+// bounds the connections served at once, each costs a reader and a writer thread
+struct connection_limit {
+    std::mutex lock;
+    std::condition_variable left;
+    int open = 0;
+
+    void enter(){
+        std::unique_lock<std::mutex> guard(lock);
+        while (open >= MAX_CONNECTIONS){
+            left.wait(guard);
+        }
+        open++;
+    }
+
+    void leave(){
+        std::lock_guard<std::mutex> guard(lock);
+        open--;
+        left.notify_one();
+    }
+};
+
+void serve_connection(std::shared_ptr<connection> conn, job_queue *queue, connection_limit *limit){
+    std::thread writer;
+    try {
+        writer = std::thread(write_responses, conn);
+    } catch (std::system_error &){
+        conn.reset();
+        limit->leave();
+        return;
+    }
+    // idle connections wait in poll, the timeouts only cut off a request or response stalled halfway
+    struct timeval timeout;
+    timeout.tv_sec = CLIENT_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::vector<job *> batch;
+    size_t batch_bytes = 0;
+    while (true){
+        // requests that already arrived are read first so they enter the queue together, and the
+        // batch is handed over before any read that could block
+        if (batch.size() >= MAX_BATCH || batch_bytes >= MAX_BATCH_BYTES || pending_bytes(conn->sock) < sizeof(daemon_request)){
+            hand_over(conn, queue, batch, batch_bytes);
+        }
+        if (batch.empty()){
+            // a client that doesn't read its responses isn't read from either
+            std::unique_lock<std::mutex> guard(conn->lock);
+            while (!conn->broken && (conn->outbox_bytes > MAX_OUTBOX_BYTES || conn->in_flight >= MAX_IN_FLIGHT)){
+                conn->changed.wait(guard);
+            }
+            guard.unlock();
+            if (!wait_readable(conn->sock)){
+                break;
+            }
+        }
+
+        // an idle connection holds no job, only one whose payload is arriving does
+        daemon_request request;
+        int fd;
+        if (!read_request(conn->sock, request, fd)){
+            break;
+        }
+
+        // a full pool or budget is waited on only after this connection's batch is queued
+        job *j = queue->acquire(false);
+        if (j == NULL){
+            hand_over(conn, queue, batch, batch_bytes);
+            j = queue->acquire(true);
+        }
+        j->request = request;
+        j->fd = fd;
+        if (request.flags & REQUEST_FD){
+            j->payload.clear();
+        } else {
+            if (pending_bytes(conn->sock) < request.size){
+                hand_over(conn, queue, batch, batch_bytes);
+            }
+            if (!queue->charge(*j, request.size, false)){
+                hand_over(conn, queue, batch, batch_bytes);
+                queue->charge(*j, request.size, true);
+            }
+            if (!read_payload(conn->sock, *j)){
+                queue->release(j);
+                break;
+            }
+        }
+        j->conn = conn;
+        batch.push_back(j);
+        batch_bytes += j->payload.size();
+    }
+    hand_over(conn, queue, batch, batch_bytes);
+    {
+        std::lock_guard<std::mutex> guard(conn->lock);
+        conn->reading_done = true;
+        conn->changed.notify_all();
+    }
+    writer.join();
+    conn.reset();
+    limit->leave();
+}
+
+// runs a request into out, reserved is the budget charged for the output before it was produced
+LONG run_job(job_queue *queue, job &j, std::vector<BYTE> &out, codec_workspaces &ws, size_t &reserved){
+    const BYTE *data = j.payload.data();
+    size_t size = j.payload.size();
+
+    // passed files are mapped and coded in place only when sealed against shrinking, the client
+    // could truncate any other file under the mapping and fault the worker, so those are copied
+    void *mapping = MAP_FAILED;
+    if (j.request.flags & REQUEST_FD){
+        int seals = fcntl(j.fd, F_GET_SEALS);
+        struct stat st;
+        if (fstat(j.fd, &st) != 0 || st.st_size == 0 || j.request.size > (size_t)st.st_size){
+            return STATUS_BAD_REQUEST;
+        }
+        size = j.request.size ? j.request.size : st.st_size;
+        if (seals >= 0 && (seals & F_SEAL_SHRINK)){
+            mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, j.fd, 0);
+            if (mapping == MAP_FAILED){
+                return STATUS_BAD_REQUEST;
+            }
+            data = (const BYTE *)mapping;
+        } else {
+            if (size > MAX_PAYLOAD){
+                return STATUS_TOO_LARGE;
+            }
+            if (!queue->charge(j, size, false) || !size_payload(j, size)){
+                return STATUS_NO_MEMORY;
+            }
+            if (!pread_all(j.fd, j.payload.data(), size)){
+                return STATUS_BAD_REQUEST;
+            }
+            data = j.payload.data();
+        }
+    }
+
+    LONG status = STATUS_OK;
+    bfh fileHeader;
+    bih infoHeader;
+    try {
+        if (j.request.op == OP_COMPRESS){
+            const BYTE *pixels;
+            if (j.request.quality < 1 || j.request.quality > 10 || !parse_bitmap(data, size, fileHeader, infoHeader, pixels)){
+                status = STATUS_BAD_REQUEST;
+            } else if ((size_t)infoHeader.biWidth * infoHeader.biHeight > MAX_PIXELS){
+                status = STATUS_TOO_LARGE;
+            } else if (!dispatch_codec(infoHeader.biBitCount, [&](auto codec){
+                           typedef decltype(codec) codec_type;
+                           codec_type::compress(fileHeader, infoHeader, pixels, j.request.quality, out, std::get<typename codec_type::workspace>(ws));
+                       })){
+                status = STATUS_UNSUPPORTED;
+            }
+        } else if (j.request.op == OP_DECOMPRESS){
+            // width and height open every compressed header, checked before anything is allocated
+            LONG dimensions[2] = {0, 0};
+            bool headers_read = peek_image_headers(data, size, fileHeader, infoHeader);
+            if (headers_read){
+                memcpy(dimensions, data, sizeof(dimensions));
+            }
+            if (!headers_read){
+                status = STATUS_CORRUPT;
+            } else if ((size_t)dimensions[0] * dimensions[1] > MAX_PIXELS){
+                status = STATUS_TOO_LARGE;
+            } else if (!dispatch_codec(infoHeader.biBitCount, [&](auto codec){
+                           // the decoded size is known up front, so it is charged before decoding
+                           typedef decltype(codec) codec_type;
+                           size_t expected = sizeof(bfh) + sizeof(bih) + codec_type::row_bytes(dimensions[0]) * dimensions[1];
+                           if (!queue->buffers->take(expected, false)){
+                               status = STATUS_NO_MEMORY;
+                               return;
+                           }
+                           reserved = expected;
+                           if (!codec_type::decompress(data, size, out, std::get<typename codec_type::workspace>(ws))){
+                               status = STATUS_CORRUPT;
+                           }
+                       })){
+                status = STATUS_UNSUPPORTED;
+            }
+        } else {
+            status = STATUS_BAD_REQUEST;
+        }
+    } catch (std::bad_alloc &){
+        status = STATUS_NO_MEMORY;
+    } catch (std::exception &){
+        status = STATUS_BAD_REQUEST;
+    }
+
+    if (mapping != MAP_FAILED){
+        munmap(mapping, size);
+    }
+    if (status != STATUS_OK){
+        out.clear();
+    }
+    return status;
+}
+
+// planes and bitstreams are what grows with the image, the tables are fixed by the alphabet
+template <typename workspace>
+size_t workspace_bytes(const workspace &ws){
+    size_t bytes = 0;
+    for (const auto &p : ws.planes){
+        bytes += p.capacity() * sizeof(p[0]);
+    }
+    for (const auto &b : ws.bitdata){
+        bytes += b.capacity();
+    }
+    return bytes;
+}
+
+template <typename workspace>
+void free_workspace(workspace &ws){
+    for (auto &p : ws.planes){
+        std::remove_reference_t<decltype(p)>().swap(p);
+    }
+    for (auto &b : ws.bitdata){
+        std::vector<BYTE>().swap(b);
+    }
+}
+
+// an oversized job would otherwise leave every worker that ran one holding its memory for good
+void trim_workspaces(codec_workspaces &ws){
+    size_t bytes = std::apply([](const auto &... w){ return (workspace_bytes(w) + ...); }, ws);
+    if (bytes > KEEP_WORKSPACE_BYTES){
+        std::apply([](auto &... w){ (free_workspace(w), ...); }, ws);
+    }
+}
+
+// workers keep their codec workspaces warm between requests, and write into output buffers
+// recycled from sent responses
+void worker(job_queue *queue){
+    std::vector<BYTE> out;
+    out.reserve(KEEP_PAYLOAD_BYTES);
+    std::unique_ptr<codec_workspaces> ws(new codec_workspaces());
+
+    while (true){
+        job *j = queue->pop();
+        out.clear();
+
+        // the charge is settled to the exact output size, compressed sizes are only known now.
+        // Workers don't wait for the budget, the jobs holding it may be queued behind them
+        daemon_response response;
+        size_t charged = 0;
+        response.id = j->request.id;
+        response.status = run_job(queue, *j, out, *ws, charged);
+        if (out.size() > charged){
+            if (queue->buffers->take(out.size() - charged, false)){
+                charged = out.size();
+            } else {
+                response.status = STATUS_NO_MEMORY;
+                out.clear();
+            }
+        }
+        queue->buffers->give(charged - out.size());
+        charged = out.size();
+        response.size = out.size();
+        j->conn->deliver(response, out, charged);
+        queue->release(j);
+
+        if (out.capacity() > KEEP_PAYLOAD_BYTES){
+            std::vector<BYTE>().swap(out);
+        }
+        trim_workspaces(*ws);
+    }
+}
+
+int main(int argc, char *argv[]){ // program name, socket path, worker count, queue depth
+    if (argc < 2){
+        fprintf(stderr, "usage: %s socket_path [workers] [queue_depth]\n", argv[0]);
+        return 1;
+    }
+    int workers = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+    int queue_depth = argc > 3 ? atoi(argv[3]) : 256;
+    if (workers < 1){
+        workers = 1;
+    }
+    if (queue_depth < 1){
+        queue_depth = 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    if (!make_socket_address(argv[1], addr)){
+        fprintf(stderr, "socket path %s is too long\n", argv[1]);
+        return 1;
+    }
+    // a socket left by an earlier run is replaced, anything else at the path is left alone
+    struct stat st;
+    if (lstat(argv[1], &st) == 0){
+        if (!S_ISSOCK(st.st_mode)){
+            fprintf(stderr, "%s exists and is not a socket\n", argv[1]);
+            return 1;
+        }
+        unlink(argv[1]);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0){
+        perror("could not listen on socket");
+        return 1;
+    }
+
+    // the pool covers a full queue plus a job being run by every worker
+    shared_buffers buffers;
+    job_queue queue(queue_depth, queue_depth + workers, &buffers);
+    for (int i = 0; i < workers; i++){
+        std::thread(worker, &queue).detach();
+    }
+    connection_limit limit;
+    fprintf(stderr, "listening on %s with %d workers\n", argv[1], workers);
+
+    while (true){
+        limit.enter();
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0){
+            limit.leave();
+            if (errno != EINTR){
+                perror("accept");
+            }
+            // out of file descriptors, give connections in flight a moment to finish
+            if (errno == EMFILE || errno == ENFILE){
+                usleep(1000);
+            }
+            continue;
+        }
+        std::shared_ptr<connection> conn;
+        try {
+            conn = std::make_shared<connection>(sock, &buffers);
+            std::thread(serve_connection, conn, &queue, &limit).detach();
+        } catch (std::exception &){
+            // once the connection exists it closes the socket when it's dropped
+            if (!conn){
+                close(sock);
+            }
+            limit.leave();
+            usleep(1000);
+        }
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef COMPRESSD_PROTOCOL_H
+#define COMPRESSD_PROTOCOL_H
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "channel_codec.h"
+
+#define OP_COMPRESS 0
+#define OP_DECOMPRESS 1
+
+#define REQUEST_FD 1 //the payload is a file passed with SCM_RIGHTS instead of bytes following the request, mapped when sealed against shrinking and copied otherwise
+
+#define STATUS_OK 0
+#define STATUS_BAD_REQUEST 1
+#define STATUS_CORRUPT 2
+#define STATUS_UNSUPPORTED 3
+#define STATUS_TOO_LARGE 4
+#define STATUS_NO_MEMORY 5 //the daemon's buffers are full, the request may be retried
+
+#define MAX_PAYLOAD (256u << 20) //largest inline payload, larger requests close the connection
+#define MAX_PIXELS (64u << 20) //largest image a request may compress or expand to
+
+#pragma pack(push, 1)
+struct daemon_request {
+    LONG id; //echoed in the response, requests on one connection may complete out of order
+    LONG op;
+    LONG quality; //1-10, compress only
+    LONG flags;
+    LONG size; //inline payload bytes, or bytes of the passed file to use (0 for all of it)
+};
+
+struct daemon_response {
+    LONG id;
+    LONG status;
+    LONG size; //payload bytes following the response
+};
+#pragma pack(pop)
+
+// sends every byte of the iovecs, the file descriptor goes along with the first byte
+inline bool send_all(int sock, struct iovec *iov, int count, int pass_fd = -1){
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    if (pass_fd >= 0){
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    while (true){
+        while (msg.msg_iovlen > 0 && msg.msg_iov[0].iov_len == 0){
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen == 0){
+            return true;
+        }
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        while (n > 0){
+            size_t step = (size_t)n < msg.msg_iov[0].iov_len ? (size_t)n : msg.msg_iov[0].iov_len;
+            msg.msg_iov[0].iov_base = (BYTE *)msg.msg_iov[0].iov_base + step;
+            msg.msg_iov[0].iov_len -= step;
+            n -= step;
+            if (msg.msg_iov[0].iov_len == 0){
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+}
+
+// receives exactly n bytes, keeping the first passed file descriptor in passed_fd and closing any other
+inline bool recv_all(int sock, void *buf, size_t n, int *passed_fd = NULL){
+    size_t got = 0;
+    while (got < n){
+        struct iovec iov;
+        iov.iov_base = (BYTE *)buf + got;
+        iov.iov_len = n - got;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        if (r == 0){
+            return false;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+                continue;
+            }
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (passed_fd != NULL && *passed_fd < 0){
+                *passed_fd = fd;
+            } else {
+                close(fd);
+            }
+        }
+        got += r;
+    }
+    return true;
+}
+
+inline bool make_socket_address(const char *path, struct sockaddr_un &addr){
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+#endif
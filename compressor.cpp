@@ -1,433 +1,222 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/mman.h>
-#include <queue>
-#include <vector>
-#include <stack>
-#include <algorithm>
+#include "channel_codec.h"
 
-typedef unsigned char BYTE;
-typedef unsigned short WORD;
-typedef unsigned int DWORD;
-typedef unsigned int LONG;
+#define SEQUENCE_PATH "compressed_sequence.xxx"
 
-#pragma pack(push, 1)
-struct bfh {
-    WORD bfType; //specifies the file type
-    DWORD bfSize; //specifies the size in bytes of the bitmap file
-    WORD bfReserved1; //reserved; must be 0
-    WORD bfReserved2; //reserved; must be 0
-    DWORD bfOffBits; //species the offset in bytes from the bitmapfileheader to the bitmap bits
-};
-
-struct bih {
-    DWORD biSize; //specifies the number of bytes required by the struct
-    LONG biWidth; //specifies width in pixels
-    LONG biHeight; //species height in pixels
-    WORD biPlanes; //specifies the number of color planes, must be 1
-    WORD biBitCount; //specifies the number of bit per pixel
-    DWORD biCompression;//spcifies the type of compression
-    DWORD biSizeImage; //size of image in bytes
-    LONG biXPelsPerMeter; //number of pixels per meter in x axis
-    LONG biYPelsPerMeter; //number of pixels per meter in y axis
-    DWORD biClrUsed; //number of colors used by the bitmap
-    DWORD biClrImportant; //number of colors that are important
-};
-
-struct compressed_image_header {
-    LONG width;
-    LONG height;
-    LONG quality;
-    LONG red_tree_size;
-    LONG green_tree_size;
-    LONG blue_tree_size;
-    LONG red_bitdata_size;
-    LONG green_bitdata_size;
-    LONG blue_bitdata_size;
-};
-#pragma pack(pop)
-
-struct bitpattern {
-    std::vector<BYTE> pattern;
-    int digit = 0;
-    int colorvalue;
-    void writebit(BYTE bit){
-        pattern.push_back(bit);
-        digit++;
-    }
-    void reset(){
-        digit = 0;
+// a sequence that can't be finished is removed, rather than left with fewer frames than its header counts
+void discard_sequence(FILE *compressed_file){
+    if (compressed_file){
+        fclose(compressed_file);
+        remove(SEQUENCE_PATH);
     }
-    void remove_last(){
-        digit--;
-    }
-};
-
-struct htn {
-    int value, freq;
-    htn *left = nullptr;
-    htn *right = nullptr;
-    int index;
-    int il = -1;
-    int ir = -1;
+}
 
-    htn(){
-        value = 0;
-        left = NULL;
-        right = NULL;
-        il = -1;
-        ir = -1;
-    }
+template <typename codec>
+int compress_sequence(int quality, int keyframe_interval, int frame_count, char **frames){
+    typedef typename codec::plane plane;
+    typedef typename codec::huff_table huff_table;
+    typedef typename codec::frame_header frame_header;
+    const int CHANNELS = codec::CHANNEL_COUNT;
+    int quality_factor = quality * 10;
 
-    htn(int v, int f, htn *l, htn *r) {
-        value = v;
-        freq = f;
-        left = l;
-        right = r;
-    }
+    std::vector<BYTE> data;
+    bfh fileHeader;
+    bih infoHeader;
+    const BYTE *pixels;
+    plane prev[CHANNELS];
+    plane cur[CHANNELS];
+    huff_table tables[CHANNELS];
+    FILE *compressed_file = NULL;
+    int width = 0;
+    int height = 0;
+    int blocks_x = 0;
+    int blocks_y = 0;
+
+    for (int f = 0; f < frame_count; f++){
+        if (!read_file(frames[f], data) || !parse_bitmap(data.data(), data.size(), fileHeader, infoHeader, pixels)){
+            fprintf(stderr, "could not read frame %s\n", frames[f]);
+            discard_sequence(compressed_file);
+            return 1;
+        }
 
-    void get_bit_pattern(std::vector<bitpattern> &bp) {
-        std::stack<std::pair<htn*, bitpattern> > s;
-        s.push(std::make_pair(this, bitpattern()));
-    
-        while (!s.empty()) {
-            auto [node, current] = s.top();
-            s.pop();
-            if (node->left == NULL && node->right == NULL) {
-                current.colorvalue = node->value;
-                bp.push_back(current);
-            } else {
-                if (node->right) {
-                    bitpattern right_copy = current;
-                    right_copy.writebit(1);
-                    s.push(std::make_pair(node->right, right_copy));
+        // the first frame fixes the size and format of the whole sequence
+        if (f == 0){
+            width = infoHeader.biWidth;
+            height = infoHeader.biHeight;
+            blocks_x = (width + SEQUENCE_BLOCK_SIZE - 1) / SEQUENCE_BLOCK_SIZE;
+            blocks_y = (height + SEQUENCE_BLOCK_SIZE - 1) / SEQUENCE_BLOCK_SIZE;
+
+            compressed_file = fopen(SEQUENCE_PATH, "wb");
+            if (compressed_file == NULL){
+                fprintf(stderr, "could not write %s\n", SEQUENCE_PATH);
+                return 1;
+            }
+            compressed_sequence_header header;
+            header.frame_count = frame_count;
+            header.width = width;
+            header.height = height;
+            header.quality = quality;
+            header.block_size = SEQUENCE_BLOCK_SIZE;
+            fwrite(&header, sizeof(compressed_sequence_header), 1, compressed_file);
+            fwrite(&fileHeader, sizeof(bfh), 1, compressed_file);
+            fwrite(&infoHeader, sizeof(bih), 1, compressed_file);
+        } else if (infoHeader.biWidth != (LONG)width || infoHeader.biHeight != (LONG)height || infoHeader.biBitCount != codec::BIT_COUNT){
+            fprintf(stderr, "frame %s does not match the size and format of the first frame\n", frames[f]);
+            discard_sequence(compressed_file);
+            return 1;
+        }
+        codec::split(pixels, width, height, quality_factor, cur);
+
+        frame_header frame;
+        bool keyframe = f == 0 || (keyframe_interval > 0 && f % keyframe_interval == 0);
+        frame.frame_type = keyframe ? KEYFRAME : DELTAFRAME;
+        frame.changed_blocks = 0;
+        frame.reused_tables = 0;
+
+        // keyframes code every value, delta frames only the residuals of blocks that changed
+        plane residuals[CHANNELS];
+        const plane *symbols = keyframe ? cur : residuals;
+        std::vector<BYTE> changed;
+        if (!keyframe){
+            changed.assign(blocks_x * blocks_y, 0);
+            for (int row = 0; row < height; row++){
+                for (int col = 0; col < width; col++){
+                    size_t i = (size_t)row * width + col;
+                    bool differs = false;
+                    codec::for_each_channel([&](auto c){
+                        differs |= cur[c][i] != prev[c][i];
+                    });
+                    if (differs){
+                        changed[(row / SEQUENCE_BLOCK_SIZE) * blocks_x + col / SEQUENCE_BLOCK_SIZE] = 1;
+                    }
                 }
-                if (node->left) {
-                    bitpattern left_copy = current;
-                    left_copy.writebit(0);
-                    s.push(std::make_pair(node->left, left_copy));
+            }
+            for (size_t b = 0; b < changed.size(); b++){
+                frame.changed_blocks += changed[b];
+            }
+            for (int row = 0; row < height; row++){
+                for (int col = 0; col < width; col++){
+                    if (!changed[(row / SEQUENCE_BLOCK_SIZE) * blocks_x + col / SEQUENCE_BLOCK_SIZE]){
+                        continue;
+                    }
+                    size_t i = (size_t)row * width + col;
+                    codec::for_each_channel([&](auto c){
+                        residuals[c].push_back(cur[c][i] - prev[c][i]);
+                    });
                 }
             }
         }
-    }
 
-    void assign_indices(int &i){
-        index = i;
-        i++;
-        if (left){
-            left->assign_indices(i);
-            il = left->index;
-        }
-        if (right){
-            right->assign_indices(i);
-            ir = right->index;
+        // picking a table for each channel, the previous one is kept whenever a new tree would not pay for itself
+        std::vector<int> freq;
+        std::vector<BYTE> bitdata[CHANNELS];
+        for (int c = 0; c < CHANNELS; c++){
+            codec::histogram(symbols[c].data(), symbols[c].size(), freq);
+
+            bool reuse = false;
+            if (!keyframe){
+                long long old_cost = codec::table_cost(freq, tables[c]);
+                if (old_cost >= 0){
+                    int used = 0;
+                    for (int i = 0; i < codec::ALPHABET; i++){
+                        used += freq[i] != 0;
+                    }
+                    // a new tree takes at least min_tree_cost and can't beat the entropy, skip building it when that bound already loses
+                    if (used == 0 || old_cost <= codec::entropy_bits(freq) + codec::min_tree_cost(used)){
+                        reuse = true;
+                    } else {
+                        huff_table fresh;
+                        codec::build_table(freq, fresh);
+                        if (old_cost <= codec::table_cost(freq, fresh) + codec::tree_cost(fresh)){
+                            reuse = true;
+                        } else {
+                            tables[c] = fresh;
+                        }
+                    }
+                }
+            }
+            if (reuse){
+                frame.reused_tables |= 1 << c;
+            } else if (keyframe || codec::table_cost(freq, tables[c]) < 0){
+                codec::build_table(freq, tables[c]);
+            }
+            frame.tree_size[c] = reuse ? 0 : codec::tree_size(tables[c]);
+            frame.bitdata_size[c] = codec::encode(symbols[c].data(), symbols[c].size(), tables[c], codec::table_cost(freq, tables[c]), bitdata[c]);
         }
-    }
 
-    int count_children(htn *node){
-        if (node == NULL){
-            return 0;
-        }
-        return 1 + count_children(node->left) + count_children(node->right);
-    }
-
-    void write_to_array(std::vector<htn> &arr, htn *node){
-        if (node == NULL){
-            return;
+        // writing frame header, changed block flags, new trees, and bitarrays to file
+        std::vector<BYTE> out;
+        append_bytes(out, &frame, sizeof(frame_header));
+        if (!keyframe){
+            bitwriter flags(out);
+            for (size_t b = 0; b < changed.size(); b++){
+                flags.put(changed[b], 1);
+            }
+            flags.flush();
         }
-        arr[node->index] = *node;
-        if (node->left){
-            arr[node->left->index] = *node->left;
-            write_to_array(arr, node->left);
+        for (int c = 0; c < CHANNELS; c++){
+            if (!(frame.reused_tables & (1 << c))){
+                codec::write_tree(tables[c], out);
+            }
         }
-        if (node->right){
-            arr[node->right->index] = *node->right;
-            write_to_array(arr, node->right);
+        for (int c = 0; c < CHANNELS; c++){
+            out.insert(out.end(), bitdata[c].begin(), bitdata[c].end());
         }
-    }
-        
-};
-
-struct color_freq {
-    int color;
-    int freq;
-};
+        fwrite(out.data(), 1, out.size(), compressed_file);
 
-struct bitarray {
-    BYTE *bitdata = NULL;
-    int bitp = 0;
-    void putbit(BYTE bit){
-        int i = bitp / 8;
-
-        int shift_amount = 7 - (bitp % 8);
-        bitdata[i] |= (bit << shift_amount);
-        bitp++;
-    }
-
-    void putbitpattern(bitpattern &bits){
-        for (int u = 0; u < bits.digit; u++){
-            putbit(bits.pattern[u]);
+        for (int c = 0; c < CHANNELS; c++){
+            prev[c].swap(cur[c]);
         }
     }
 
-    bitarray(int size){
-        bitdata = new BYTE[size]();
+    if (ferror(compressed_file) || fclose(compressed_file) != 0){
+        fprintf(stderr, "could not write %s\n", SEQUENCE_PATH);
+        remove(SEQUENCE_PATH);
+        return 1;
     }
-};
-
-bool compare_color_freq(color_freq a, color_freq b){
-    return a.freq < b.freq;
-}
-
-bool compare_htn(htn a, htn b){
-    return a.freq > b.freq;
+    return 0;
 }
 
 int main(int argc, char *argv[]){ // program name, img path, quality (1-10)
-
-    // reading input bitmap
-    FILE *file = fopen(argv[1], "rb");
-    int quality = atoi(argv[2]);
-    bfh fileHeader;
-    bih infoHeader;
-    fread(&fileHeader, sizeof(bfh), 1, file);
-    fread(&infoHeader, sizeof(bih), 1, file);
-    BYTE *img_data = (BYTE *)malloc(infoHeader.biSizeImage);
-    fread(img_data, infoHeader.biSizeImage, 1, file);
-    fclose(file);
-
-    // pixel sizes and padding calculations
-    int pixel_width = infoHeader.biWidth * 3;
-    int padding;
-    if (pixel_width % 4 == 0){
-        padding = 0;
-    } else {
-        padding = 4 - (pixel_width % 4);
-    }
-
-    pixel_width += padding;
-
-    // creating individual color arrays
-    BYTE *red_data = (BYTE *)malloc(infoHeader.biSizeImage);
-    BYTE *green_data = (BYTE *)malloc(infoHeader.biSizeImage);
-    BYTE *blue_data = (BYTE *)malloc(infoHeader.biSizeImage);
-    for (int row = 0; row < infoHeader.biHeight; row++){
-        for (int col = 0; col < infoHeader.biWidth; col++){
-            int index = row * pixel_width + col * 3;
-            red_data[row * infoHeader.biWidth + col] = img_data[index + 2];
-            green_data[row * infoHeader.biWidth + col] = img_data[index + 1];
-            blue_data[row * infoHeader.biWidth + col] = img_data[index];
-        }
-    }
-
-    int quality_factor = quality * 10;
-    for (int i = 0; i < infoHeader.biSizeImage; i++) {
-        red_data[i] = (red_data[i] / quality_factor);
-        green_data[i] = (green_data[i] / quality_factor);
-        blue_data[i] = (blue_data[i] / quality_factor);
+    bool sequence = argc > 1 && strcmp(argv[1], "-s") == 0;
+    if (sequence ? argc < 5 : argc < 3){
+        fprintf(stderr, "usage: %s image.bmp quality\n", argv[0]);
+        fprintf(stderr, "       %s -s quality keyframe_interval frame1.bmp [frame2.bmp ...]\n", argv[0]);
+        return 1;
     }
-
-    // frequency tables of each color
-    std::vector<color_freq> red_freq(256);
-    std::vector<color_freq> green_freq(256);
-    std::vector<color_freq> blue_freq(256);
-    for (int i = 0; i < 256; i++) {
-        red_freq[i].color = i;
-        red_freq[i].freq = 0;
-
-        green_freq[i].color = i;
-        green_freq[i].freq = 0;
-
-        blue_freq[i].color = i;
-        blue_freq[i].freq = 0;
-    }
-    for (int i = 0; i < infoHeader.biHeight * infoHeader.biWidth; i++) {
-        red_freq[red_data[i]].freq++;
-        green_freq[green_data[i]].freq++;
-        blue_freq[blue_data[i]].freq++;
-    }
-
-    // sorting each frequency table with qsort (least frequency first)
-    std::sort(red_freq.begin(), red_freq.end(), compare_color_freq);
-    std::sort(green_freq.begin(), green_freq.end(), compare_color_freq);
-    std::sort(blue_freq.begin(), blue_freq.end(), compare_color_freq);
-
-    // declaring vectors for each color, these will be used to construct the trees
-    std::vector<htn> red_list;
-    std::vector<htn> green_list;
-    std::vector<htn> blue_list;
-
-    // creating red huff tree, skipping colors that don't appear
-    for (int i = 0; i < 256; i++) {
-        if (red_freq[i].freq == 0) {
-            continue;
-        }
-        red_list.emplace_back(htn(red_freq[i].color, red_freq[i].freq, NULL, NULL));
-    }
-    while (red_list.size() > 1) {
-        std::sort(red_list.begin(), red_list.end(), compare_htn);
-        htn *left = new htn(red_list[0]);
-        htn *right = new htn(red_list[1]);
-        red_list.erase(red_list.begin(), red_list.begin() + 2);
-        red_list.emplace_back(htn(-1, left->freq + right->freq, left, right));
-    }
-
-    // creating green huff tree, skipping colors that don't appear
-    for (int i = 0; i < 256; i++) {
-        if (green_freq[i].freq == 0) {
-            continue;
-        }
-        green_list.emplace_back(htn(green_freq[i].color, green_freq[i].freq, NULL, NULL));
-    }
-    while (green_list.size() > 1) {
-        std::sort(green_list.begin(), green_list.end(), compare_htn);
-        htn *left = new htn(green_list[0]);
-        htn *right = new htn(green_list[1]);
-        green_list.erase(green_list.begin(), green_list.begin() + 2);
-        green_list.emplace_back(htn(-1, left->freq + right->freq, left, right));
-
-    }
-
-    // creating blue huff tree, skipping colors that don't appear
-    for (int i = 0; i < 256; i++) {
-        if (blue_freq[i].freq == 0) {
-            continue;
-        }
-        blue_list.emplace_back(htn(blue_freq[i].color, blue_freq[i].freq, NULL, NULL));
+    int quality = atoi(argv[2]);
+    if (quality < 1 || quality > 10){
+        fprintf(stderr, "quality must be between 1 and 10\n");
+        return 1;
     }
-    while (blue_list.size() > 1) {
-        std::sort(blue_list.begin(), blue_list.end(), compare_htn);
-        htn *left = new htn(blue_list[0]);
-        htn *right = new htn(blue_list[1]);
-        blue_list.erase(blue_list.begin(), blue_list.begin() + 2);
-        blue_list.emplace_back(htn(-1, left->freq + right->freq, left, right));
 
+    // reading input bitmap, or the first frame of a sequence to pick the codec
+    const char *path = sequence ? argv[4] : argv[1];
+    std::vector<BYTE> data;
+    bfh fileHeader;
+    bih infoHeader;
+    const BYTE *pixels;
+    if (!read_file(path, data) || !parse_bitmap(data.data(), data.size(), fileHeader, infoHeader, pixels)){
+        fprintf(stderr, "could not read bitmap %s\n", path);
+        return 1;
     }
 
-    // writing red huffman codes to a vector of bitpatterns
-    std::vector<bitpattern> red_patterns;
-    red_list[0].get_bit_pattern(red_patterns);
-
-    // writing green huffman codes to a vector of bitpatterns
-    std::vector<bitpattern> green_patterns;
-    green_list[0].get_bit_pattern(green_patterns);
-
-    // writing blue huffman codes to a vector of bitpatterns
-    std::vector<bitpattern> blue_patterns;
-    blue_list[0].get_bit_pattern(blue_patterns);
-
-    // combining bitpatterns from vectors into a single bitpattern using image data
-    bitpattern red_pattern;
-    bitpattern green_pattern;
-    bitpattern blue_pattern;
-    for (int i = 0; i < infoHeader.biHeight * infoHeader.biWidth; i++){
-        for (int j = 0; j < red_patterns.size(); j++){
-            if (red_data[i] == red_patterns[j].colorvalue){
-                for (int k = 0; k < red_patterns[j].digit; k++){
-                    red_pattern.writebit(red_patterns[j].pattern[k]);
-                }
-            }
-        }
-        for (int j = 0; j < green_patterns.size(); j++){
-            if (green_data[i] == green_patterns[j].colorvalue){
-                for (int k = 0; k < green_patterns[j].digit; k++){
-                    green_pattern.writebit(green_patterns[j].pattern[k]);
-                }
-            }
+    int result = 0;
+    bool supported = dispatch_codec(infoHeader.biBitCount, [&](auto codec){
+        typedef decltype(codec) codec_type;
+        if (sequence){
+            result = compress_sequence<codec_type>(quality, atoi(argv[3]), argc - 4, argv + 4);
+            return;
         }
-        for (int j = 0; j < blue_patterns.size(); j++){
-            if (blue_data[i] == blue_patterns[j].colorvalue){
-                for (int k = 0; k < blue_patterns[j].digit; k++){
-                    blue_pattern.writebit(blue_patterns[j].pattern[k]);
-                }
-            }
+        std::vector<BYTE> compressed;
+        codec_type::compress(fileHeader, infoHeader, pixels, quality, compressed);
+        if (!write_file("compressed_image.xxx", compressed)){
+            fprintf(stderr, "could not write compressed_image.xxx\n");
+            result = 1;
         }
+    });
+    if (!supported){
+        fprintf(stderr, "unsupported bitmap with %d bits per pixel\n", infoHeader.biBitCount);
+        return 1;
     }
-    
-    // writing red bitpattern to bitarray
-    bitarray red_bitarray((red_pattern.pattern.size() + 7) / 8);
-    red_bitarray.putbitpattern(red_pattern);
-
-    // writing green bitpattern to bitarray
-    bitarray green_bitarray((green_pattern.pattern.size() + 7) / 8);
-    green_bitarray.putbitpattern(green_pattern);
-
-    // writing blue bitpattern to bitarray
-    bitarray blue_bitarray((blue_pattern.pattern.size() + 7) / 8);
-    blue_bitarray.putbitpattern(blue_pattern);
-
-    // assigning indices for each tree
-    int i = 0;
-    red_list[0].assign_indices(i);
-    i = 0;
-    green_list[0].assign_indices(i);
-    i = 0;
-    blue_list[0].assign_indices(i);
-
-    // getting tree node counts
-    int red_node_count = red_list[0].count_children(&red_list[0]);
-    int green_node_count = green_list[0].count_children(&green_list[0]);
-    int blue_node_count = blue_list[0].count_children(&blue_list[0]);
-
-    // creating arrays for huff trees
-    std::vector<htn> red_arr(red_node_count);
-    std::vector<htn> green_arr(green_node_count);
-    std::vector<htn> blue_arr(blue_node_count);
-
-    // copying huff trees to arrays using left and right indices
-    red_list[0].write_to_array(red_arr, &red_list[0]);
-    green_list[0].write_to_array(green_arr, &green_list[0]);
-    blue_list[0].write_to_array(blue_arr, &blue_list[0]);
-    
-    // creating compressed file
-    FILE *compressed_file = fopen("compressed_image.xxx", "wb");
-
-    // setting up header
-    compressed_image_header header;
-    header.width = infoHeader.biWidth;
-    header.height = infoHeader.biHeight;
-    header.quality = quality;
-    header.red_tree_size = red_node_count;
-    header.green_tree_size = green_node_count;
-    header.blue_tree_size = blue_node_count;
-    header.red_bitdata_size = red_pattern.pattern.size();
-    header.green_bitdata_size = green_pattern.pattern.size();
-    header.blue_bitdata_size = blue_pattern.pattern.size();
-
-    // writing header, huff arrays, and bitarrays to file
-    fwrite(&header, sizeof(compressed_image_header), 1, compressed_file);
-    for (int i = 0; i < red_node_count; i++){
-        fwrite(&red_arr[i].value, sizeof(int), 1, compressed_file);
-        fwrite(&red_arr[i].freq, sizeof(int), 1, compressed_file);
-        fwrite(&red_arr[i].il, sizeof(int), 1, compressed_file);
-        fwrite(&red_arr[i].ir, sizeof(int), 1, compressed_file);
-    }
-    for (int i = 0; i < green_node_count; i++){
-        fwrite(&green_arr[i].value, sizeof(int), 1, compressed_file);
-        fwrite(&green_arr[i].freq, sizeof(int), 1, compressed_file);
-        fwrite(&green_arr[i].il, sizeof(int), 1, compressed_file);
-        fwrite(&green_arr[i].ir, sizeof(int), 1, compressed_file);
-    }
-    for (int i = 0; i < blue_node_count; i++){
-        fwrite(&blue_arr[i].value, sizeof(int), 1, compressed_file);
-        fwrite(&blue_arr[i].freq, sizeof(int), 1, compressed_file);
-        fwrite(&blue_arr[i].il, sizeof(int), 1, compressed_file);
-        fwrite(&blue_arr[i].ir, sizeof(int), 1, compressed_file);
-    }
-    fwrite(red_bitarray.bitdata, 1, (red_pattern.digit+7)/8, compressed_file);
-    fwrite(green_bitarray.bitdata, 1, (green_pattern.digit+7)/8, compressed_file);
-    fwrite(blue_bitarray.bitdata, 1, (blue_pattern.digit+7)/8, compressed_file);
-
-    // writing original headers to reconstruct image
-    fwrite(&fileHeader, sizeof(bfh), 1, compressed_file);
-    fwrite(&infoHeader, sizeof(bih), 1, compressed_file);
-
-    // cleanup
-    fclose(compressed_file);
-    free(img_data);
-    free(red_data);
-    free(green_data);
-    free(blue_data);
-
-    return 0;
-}
\ No newline at end of file
+    return result;
+}
@@ -1,275 +1,189 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/mman.h>
-#include <queue>
-#include <vector>
-
-typedef unsigned char BYTE;
-typedef unsigned short WORD;
-typedef unsigned int DWORD;
-typedef unsigned int LONG;
-
-#pragma pack(push, 1)
-struct bfh {
-    WORD bfType; //specifies the file type
-    DWORD bfSize; //specifies the size in bytes of the bitmap file
-    WORD bfReserved1; //reserved; must be 0
-    WORD bfReserved2; //reserved; must be 0
-    DWORD bfOffBits; //species the offset in bytes from the bitmapfileheader to the bitmap bits
-};
-
-struct bih {
-    DWORD biSize; //specifies the number of bytes required by the struct
-    LONG biWidth; //specifies width in pixels
-    LONG biHeight; //species height in pixels
-    WORD biPlanes; //specifies the number of color planes, must be 1
-    WORD biBitCount; //specifies the number of bit per pixel
-    DWORD biCompression;//spcifies the type of compression
-    DWORD biSizeImage; //size of image in bytes
-    LONG biXPelsPerMeter; //number of pixels per meter in x axis
-    LONG biYPelsPerMeter; //number of pixels per meter in y axis
-    DWORD biClrUsed; //number of colors used by the bitmap
-    DWORD biClrImportant; //number of colors that are important
-};
-struct compressed_image_header {
-    LONG width;
-    LONG height;
-    LONG quality;
-    LONG red_tree_size;
-    LONG green_tree_size;
-    LONG blue_tree_size;
-    LONG red_bitdata_size;
-    LONG green_bitdata_size;
-    LONG blue_bitdata_size;
-};
-#pragma pack(pop)
-struct htn {
-    int value, freq;
-    htn *left = nullptr;
-    htn *right = nullptr;
-    int index;
-    int il, ir = -1;
-
-    htn(){
-        value = 0;
-        left = NULL;
-        right = NULL;
-        il = 0;
-        ir = 0;
-    }
-
-    htn(int v, int f, htn *l, htn *r) {
-        value = v;
-        freq = f;
-        left = l;
-        right = r;
-        il = 0;
-        ir = 0;
-    }   
-};
-
-struct bitarray {
-    BYTE *bitdata = NULL;
-    int bitp = 0;
-
-    bitarray(int size){
-        bitdata = new BYTE[size];
-    }
-
-    BYTE getbit(){
-        int i = bitp / 8;
-        int actual_bitp = bitp % 8;
-
-        BYTE targetbit = (bitdata[i] >> (7 - actual_bitp)) & 1;
-        bitp++;
-        return targetbit;
-    }
-};
-
-int main(int argc, char *argv[]){ // program name, compressed file, output file
-    FILE *compressed_file = fopen(argv[1], "rb");
-
-    // read header
-    compressed_image_header header;
-    bfh fileHeader;
-    bih infoHeader;
-    fread(&header, sizeof(compressed_image_header), 1, compressed_file);
-
-    // read huff arrays
-    std::vector<htn> red_arr(header.red_tree_size);
-    std::vector<htn> green_arr(header.green_tree_size);
-    std::vector<htn> blue_arr(header.blue_tree_size);
-
-    for (int i = 0; i < header.red_tree_size; i++){
-        fread(&red_arr[i].value, sizeof(int), 1, compressed_file);
-        fread(&red_arr[i].freq, sizeof(int), 1, compressed_file);
-        fread(&red_arr[i].il, sizeof(int), 1, compressed_file);
-        fread(&red_arr[i].ir, sizeof(int), 1, compressed_file);
-    }
-    for (int i = 0; i < header.green_tree_size; i++){
-        fread(&green_arr[i].value, sizeof(int), 1, compressed_file);
-        fread(&green_arr[i].freq, sizeof(int), 1, compressed_file);
-        fread(&green_arr[i].il, sizeof(int), 1, compressed_file);
-        fread(&green_arr[i].ir, sizeof(int), 1, compressed_file);
-    }
-    for (int i = 0; i < header.blue_tree_size; i++){
-        fread(&blue_arr[i].value, sizeof(int), 1, compressed_file);
-        fread(&blue_arr[i].freq, sizeof(int), 1, compressed_file);
-        fread(&blue_arr[i].il, sizeof(int), 1, compressed_file);
-        fread(&blue_arr[i].ir, sizeof(int), 1, compressed_file);
-    }
-
-    // read bitarrays
-    bitarray red_bitarray(header.red_bitdata_size);
-    bitarray green_bitarray(header.green_bitdata_size);
-    bitarray blue_bitarray(header.blue_bitdata_size);
-
-    fread(red_bitarray.bitdata, sizeof(BYTE), (header.red_bitdata_size+7)/8, compressed_file);
-    fread(green_bitarray.bitdata, sizeof(BYTE), (header.green_bitdata_size+7)/8, compressed_file);
-    fread(blue_bitarray.bitdata, sizeof(BYTE), (header.blue_bitdata_size+7)/8, compressed_file);
-
-    // reading original headers
-    fread(&fileHeader, sizeof(bfh), 1, compressed_file);
-    fread(&infoHeader, sizeof(bih), 1, compressed_file);
-
-    // close file
-    fclose(compressed_file);
-
-    // reconstruct red huff tree
-    for (int i = 0; i < header.red_tree_size; i++){
-        if (red_arr[i].il != -1){
-            red_arr[i].left = &red_arr[red_arr[i].il];
-        }
-        if (red_arr[i].ir != -1){
-            red_arr[i].right = &red_arr[red_arr[i].ir];
-        }
+#include "channel_codec.h"
+
+template <typename codec>
+int decompress_sequence(byte_reader &in, compressed_sequence_header &header, bfh &fileHeader, bih &infoHeader, const char *prefix){
+    typedef typename codec::plane plane;
+    typedef typename codec::huff_table huff_table;
+    typedef typename codec::frame_header frame_header;
+    const int CHANNELS = codec::CHANNEL_COUNT;
+
+    // a block larger than the image is only written for images smaller than the default block size
+    if (header.width > INT_MAX || header.height > INT_MAX || header.block_size == 0
+        || (header.block_size > SEQUENCE_BLOCK_SIZE && header.block_size > header.width && header.block_size > header.height)){
+        fprintf(stderr, "corrupt sequence header\n");
+        return 1;
     }
+    int width = header.width;
+    int height = header.height;
+    int block_size = header.block_size;
+    size_t blocks_x = ((size_t)width + block_size - 1) / block_size;
+    size_t blocks_y = ((size_t)height + block_size - 1) / block_size;
+    int quality_factor = header.quality * 10;
 
-    // reconstruct green huff tree
-    for (int i = 0; i < header.green_tree_size; i++){
-        if (green_arr[i].il != -1){
-            green_arr[i].left = &green_arr[green_arr[i].il];
-        }
-        if (green_arr[i].ir != -1){
-            green_arr[i].right = &green_arr[green_arr[i].ir];
-        }
+    size_t pixel_bytes = codec::row_bytes(width) * height;
+    rewrite_output_headers(fileHeader, infoHeader, pixel_bytes);
+    std::vector<BYTE> out(sizeof(bfh) + sizeof(bih) + pixel_bytes);
+    memcpy(out.data(), &fileHeader, sizeof(bfh));
+    memcpy(out.data() + sizeof(bfh), &infoHeader, sizeof(bih));
+
+    // trees persist across frames so delta frames can reuse them
+    huff_table tables[CHANNELS];
+    plane planes[CHANNELS];
+    plane symbols[CHANNELS];
+    std::vector<BYTE> changed(blocks_x * blocks_y);
+    for (int c = 0; c < CHANNELS; c++){
+        planes[c].assign((size_t)width * height, 0);
     }
 
-    // reconstruct blue huff tree
-    for (int i = 0; i < header.blue_tree_size; i++){
-        if (blue_arr[i].il != -1){
-            blue_arr[i].left = &blue_arr[blue_arr[i].il];
-        }
-        if (blue_arr[i].ir != -1){
-            blue_arr[i].right = &blue_arr[blue_arr[i].ir];
+    for (LONG f = 0; f < header.frame_count; f++){
+        frame_header frame;
+        if (!in.read(&frame, sizeof(frame_header))){
+            fprintf(stderr, "sequence ends after %u frames\n", f);
+            return 1;
+        }
+        if (frame.frame_type != KEYFRAME && frame.frame_type != DELTAFRAME){
+            fprintf(stderr, "corrupt frame type in frame %u\n", f);
+            return 1;
+        }
+
+        // read changed block flags and count the residuals they cover
+        size_t count = (size_t)width * height;
+        if (frame.frame_type == DELTAFRAME){
+            const BYTE *flag_data = in.take((changed.size() + 7) / 8);
+            if (flag_data == NULL){
+                fprintf(stderr, "sequence ends after %u frames\n", f);
+                return 1;
+            }
+            bitreader flags(flag_data, (changed.size() + 7) / 8);
+            size_t flagged = 0;
+            for (size_t b = 0; b < changed.size(); b++){
+                changed[b] = flags.getbit();
+                flagged += changed[b];
+            }
+            if (flagged != frame.changed_blocks){
+                fprintf(stderr, "corrupt changed blocks in frame %u\n", f);
+                return 1;
+            }
+
+            count = 0;
+            for (int row = 0; row < height; row++){
+                for (int col = 0; col < width; col++){
+                    count += changed[(row / block_size) * blocks_x + col / block_size];
+                }
+            }
+        }
+
+        // read new trees, reused ones are left as they were
+        for (int c = 0; c < CHANNELS; c++){
+            if (!(frame.reused_tables & (1 << c)) && !codec::read_tree(in, frame.tree_size[c], tables[c])){
+                fprintf(stderr, "corrupt tree in frame %u\n", f);
+                return 1;
+            }
+        }
+
+        // read and decode bitarrays
+        for (int c = 0; c < CHANNELS; c++){
+            size_t bytes = ((size_t)frame.bitdata_size[c] + 7) / 8;
+            const BYTE *bitdata = in.take(bytes);
+            // every value takes at least one bit unless the tree is a single leaf
+            if (bitdata == NULL || (count > 0 && tables[c].arr.empty()) || (tables[c].arr.size() > 1 && count > frame.bitdata_size[c])){
+                fprintf(stderr, "corrupt bitdata in frame %u\n", f);
+                return 1;
+            }
+            symbols[c].resize(count);
+            codec::decode(bitdata, bytes, tables[c], count, symbols[c].data());
+        }
+
+        // keyframes replace every value, delta frames add residuals to the changed blocks of the previous frame
+        if (frame.frame_type == KEYFRAME){
+            for (int c = 0; c < CHANNELS; c++){
+                planes[c].swap(symbols[c]);
+            }
+        } else {
+            size_t s = 0;
+            for (int row = 0; row < height; row++){
+                for (int col = 0; col < width; col++){
+                    if (!changed[(row / block_size) * blocks_x + col / block_size]){
+                        continue;
+                    }
+                    size_t i = (size_t)row * width + col;
+                    codec::for_each_channel([&](auto c){
+                        planes[c][i] += symbols[c][s];
+                    });
+                    s++;
+                }
+            }
+        }
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s_%04u.bmp", prefix, f);
+        codec::merge(planes, width, height, quality_factor, out.data() + sizeof(bfh) + sizeof(bih));
+        if (!write_file(path, out)){
+            fprintf(stderr, "could not write %s\n", path);
+            return 1;
         }
     }
 
-    // storing roots for ease of access
-    htn *red_root = &red_arr[0];
-    htn *green_root = &green_arr[0];
-    htn *blue_root = &blue_arr[0];
-
-    // creating arrays for each color for the image
-    std::vector<BYTE> red_vals;
-    std::vector<BYTE> green_vals;
-    std::vector<BYTE> blue_vals;
+    return 0;
+}
 
-    // traversing red huff tree with bitarray getbit()
-    htn *current = red_root;
-    int byte_index = 0;
-    while (byte_index < header.width * header.height){
-        BYTE bit = red_bitarray.getbit();
-        if (bit == 0){
-            current = current->left;
-        }
-        else {
-            current = current->right;
-        }
-        if (current->left == NULL && current->right == NULL){
-            red_vals.push_back(current->value);
-            byte_index++;
-            current = red_root;
-        }
+int main(int argc, char *argv[]){ // program name, compressed file, output file
+    bool sequence = argc > 1 && strcmp(argv[1], "-s") == 0;
+    if (argc < (sequence ? 4 : 3)){
+        fprintf(stderr, "usage: %s compressed_image output.bmp\n", argv[0]);
+        fprintf(stderr, "       %s -s compressed_sequence output_prefix\n", argv[0]);
+        return 1;
     }
 
-    // traversing green huff tree with bitarray getbit()
-    current = green_root;
-    byte_index = 0;
-    while (byte_index < header.width * header.height){
-        BYTE bit = green_bitarray.getbit();
-        if (bit == 0){
-            current = current->left;
-        }
-        else {
-            current = current->right;
-        }
-        if (current->left == NULL && current->right == NULL){
-            green_vals.push_back(current->value);
-            byte_index++;
-            current = green_root;
-        }
+    const char *path = sequence ? argv[2] : argv[1];
+    std::vector<BYTE> data;
+    if (!read_file(path, data)){
+        fprintf(stderr, "could not read %s\n", path);
+        return 1;
     }
 
-    // traversing blue huff tree with bitarray getbit()
-    current = blue_root;
-    byte_index = 0;
-    while (byte_index < header.width * header.height){
-        BYTE bit = blue_bitarray.getbit();
-        if (bit == 0){
-            current = current->left;
-        }
-        else {
-            current = current->right;
-        }
-        if (current->left == NULL && current->right == NULL){
-            blue_vals.push_back(current->value);
-            byte_index++;
-            current = blue_root;
-        }
-    }
-
-    // writing decompressed image headers
-    FILE *decompressed_file = fopen(argv[2], "wb");
-    fwrite(&fileHeader, sizeof(bfh), 1, decompressed_file);
-    fwrite(&infoHeader, sizeof(bih), 1, decompressed_file);
-    
-    // padding, pixel dimensions, and quality
-    int pixel_width = header.width * 3;
-    int padding;
-    if (pixel_width % 4 == 0){
-        padding = 0;
+    // read original headers to pick the codec
+    compressed_sequence_header header;
+    bfh fileHeader;
+    bih infoHeader;
+    byte_reader in(data.data(), data.size());
+    bool headers_read;
+    if (sequence){
+        headers_read = in.read(&header, sizeof(compressed_sequence_header)) && in.read(&fileHeader, sizeof(bfh)) && in.read(&infoHeader, sizeof(bih));
     } else {
-        padding = 4 - (pixel_width % 4);
+        headers_read = peek_image_headers(data.data(), data.size(), fileHeader, infoHeader);
     }
-
-    pixel_width += padding;
-    int quality_factor = header.quality * 10;
-    // restoring quality scaling
-    for (int i = 0; i < header.width * header.height; i++){
-        red_vals[i] *= quality_factor;
-        green_vals[i] *= quality_factor;
-        blue_vals[i] *= quality_factor;
+    if (!headers_read){
+        fprintf(stderr, "%s is too short to be compressed\n", path);
+        return 1;
     }
 
-    // writing decompressed image data with padding
-    for (int row = 0; row < header.height; row++){
-        for (int col = 0; col < header.width; col++){
-            BYTE red = red_vals[row * header.width + col];
-            BYTE green = green_vals[row * header.width + col];
-            BYTE blue = blue_vals[row * header.width + col];
-            fwrite(&blue, sizeof(BYTE), 1, decompressed_file);
-            fwrite(&green, sizeof(BYTE), 1, decompressed_file);
-            fwrite(&red, sizeof(BYTE), 1, decompressed_file);
-        }
-
-        for (int i = 0; i < padding; i++){
-            BYTE pad = 0;
-            fwrite(&pad, sizeof(BYTE), 1, decompressed_file);
-        }
+    // dimensions that pass every check can still be too large to allocate
+    int result = 0;
+    bool supported;
+    try {
+        supported = dispatch_codec(infoHeader.biBitCount, [&](auto codec){
+            typedef decltype(codec) codec_type;
+            if (sequence){
+                result = decompress_sequence<codec_type>(in, header, fileHeader, infoHeader, argv[3]);
+                return;
+            }
+            std::vector<BYTE> decompressed;
+            if (!codec_type::decompress(data.data(), data.size(), decompressed)){
+                fprintf(stderr, "%s is corrupt\n", path);
+                result = 1;
+            } else if (!write_file(argv[2], decompressed)){
+                fprintf(stderr, "could not write %s\n", argv[2]);
+                result = 1;
+            }
+        });
+    } catch (std::exception &){
+        fprintf(stderr, "%s is too large to decompress\n", path);
+        return 1;
     }
-
-    fclose(decompressed_file);
-
-    return 0;
-}
\ No newline at end of file
+    if (!supported){
+        fprintf(stderr, "unsupported bitmap with %d bits per pixel\n", infoHeader.biBitCount);
+        return 1;
+    }
+    return result;
+}
@@ -0,0 +1,224 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "compressd_protocol.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+struct load_settings {
+    const char *socket_path;
+    int op;
+    int quality;
+    bool pass_fd;
+    int image_fd;
+    const std::vector<BYTE> *payload;
+    int requests; //per connection
+    int window; //requests in flight per connection
+};
+
+struct connection_result {
+    std::vector<double> latencies; //microseconds
+    int errors = 0;
+};
+
+double elapsed_us(clock_type::time_point start, clock_type::time_point end){
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// sends requests on one connection with up to window of them in flight, timing each until its response
+void run_connection(const load_settings *settings, connection_result *result){
+    struct sockaddr_un addr;
+    make_socket_address(settings->socket_path, addr);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+        perror("could not connect to daemon");
+        result->errors = settings->requests;
+        if (sock >= 0){
+            close(sock);
+        }
+        return;
+    }
+
+    std::vector<clock_type::time_point> starts(settings->requests);
+    std::mutex lock;
+    std::condition_variable window_open;
+    int in_flight = 0;
+
+    std::thread sender([&](){
+        for (int i = 0; i < settings->requests; i++){
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                while (in_flight >= settings->window){
+                    window_open.wait(guard);
+                }
+                in_flight++;
+                starts[i] = clock_type::now();
+            }
+            daemon_request request;
+            request.id = i;
+            request.op = settings->op;
+            request.quality = settings->quality;
+            request.flags = settings->pass_fd ? REQUEST_FD : 0;
+            request.size = settings->pass_fd ? 0 : settings->payload->size();
+            struct iovec iov[2];
+            iov[0].iov_base = &request;
+            iov[0].iov_len = sizeof(daemon_request);
+            iov[1].iov_base = (void *)settings->payload->data();
+            iov[1].iov_len = settings->pass_fd ? 0 : settings->payload->size();
+            if (!send_all(sock, iov, 2, settings->pass_fd ? settings->image_fd : -1)){
+                break;
+            }
+        }
+    });
+
+    std::vector<BYTE> body;
+    result->latencies.reserve(settings->requests);
+    for (int i = 0; i < settings->requests; i++){
+        daemon_response response;
+        if (!recv_all(sock, &response, sizeof(daemon_response))){
+            result->errors += settings->requests - i;
+            break;
+        }
+        body.resize(response.size);
+        if (!recv_all(sock, body.data(), body.size()) || response.id >= (LONG)settings->requests){
+            result->errors += settings->requests - i;
+            break;
+        }
+        clock_type::time_point end = clock_type::now();
+        if (response.status != STATUS_OK){
+            result->errors++;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        result->latencies.push_back(elapsed_us(starts[response.id], end));
+        in_flight--;
+        window_open.notify_one();
+    }
+
+    // a sender stuck on a full window is released by shutting the socket down
+    shutdown(sock, SHUT_RDWR);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        in_flight = 0;
+        window_open.notify_one();
+    }
+    sender.join();
+    close(sock);
+}
+
+double percentile(std::vector<double> &sorted, double p){
+    if (sorted.empty()){
+        return 0;
+    }
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+int main(int argc, char *argv[]){ // program name, socket path, image, requests, connections, window, mode
+    if (argc < 3){
+        fprintf(stderr, "usage: %s socket_path image.bmp [requests] [connections] [window] [compress|compress-fd|decompress]\n", argv[0]);
+        return 1;
+    }
+    int requests = argc > 3 ? atoi(argv[3]) : 10000;
+    int connections = argc > 4 ? atoi(argv[4]) : 1;
+    int window = argc > 5 ? atoi(argv[5]) : 1;
+    const char *mode = argc > 6 ? argv[6] : "compress";
+    int quality = 1;
+    if (requests < 1 || connections < 1 || window < 1){
+        fprintf(stderr, "requests, connections and window must be positive\n");
+        return 1;
+    }
+
+    std::vector<BYTE> image;
+    bfh fileHeader;
+    bih infoHeader;
+    const BYTE *pixels;
+    if (!read_file(argv[2], image) || !parse_bitmap(image.data(), image.size(), fileHeader, infoHeader, pixels)){
+        fprintf(stderr, "could not read bitmap %s\n", argv[2]);
+        return 1;
+    }
+
+    load_settings settings;
+    settings.socket_path = argv[1];
+    settings.quality = quality;
+    settings.pass_fd = strcmp(mode, "compress-fd") == 0;
+    settings.op = strcmp(mode, "decompress") == 0 ? OP_DECOMPRESS : OP_COMPRESS;
+    settings.image_fd = -1;
+    settings.window = window;
+    settings.requests = (requests + connections - 1) / connections;
+    if (settings.op == OP_COMPRESS && !settings.pass_fd && strcmp(mode, "compress") != 0){
+        fprintf(stderr, "unknown mode %s\n", mode);
+        return 1;
+    }
+
+    // timing the codec in process gives the baseline the daemon's overhead is measured against
+    std::vector<BYTE> compressed;
+    std::vector<BYTE> scratch;
+    std::vector<double> codec_times;
+    bool supported = dispatch_codec(infoHeader.biBitCount, [&](auto codec){
+        typedef decltype(codec) codec_type;
+        typename codec_type::workspace ws;
+        codec_type::compress(fileHeader, infoHeader, pixels, quality, compressed, ws);
+        int samples = requests < 1000 ? requests : 1000;
+        for (int i = 0; i < samples; i++){
+            scratch.clear();
+            clock_type::time_point start = clock_type::now();
+            if (settings.op == OP_COMPRESS){
+                codec_type::compress(fileHeader, infoHeader, pixels, quality, scratch, ws);
+            } else {
+                codec_type::decompress(compressed.data(), compressed.size(), scratch, ws);
+            }
+            codec_times.push_back(elapsed_us(start, clock_type::now()));
+        }
+    });
+    if (!supported){
+        fprintf(stderr, "unsupported bitmap with %d bits per pixel\n", infoHeader.biBitCount);
+        return 1;
+    }
+    settings.payload = settings.op == OP_COMPRESS ? &image : &compressed;
+    // the image goes in a sealed memfd, which the daemon maps instead of copying
+    if (settings.pass_fd){
+        settings.image_fd = memfd_create("loadgen", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (settings.image_fd < 0 || write(settings.image_fd, image.data(), image.size()) != (ssize_t)image.size()
+            || fcntl(settings.image_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0){
+            perror("could not create sealed memfd");
+            return 1;
+        }
+    }
+
+    std::vector<connection_result> results(connections);
+    std::vector<std::thread> threads;
+    clock_type::time_point start = clock_type::now();
+    for (int i = 0; i < connections; i++){
+        threads.emplace_back(run_connection, &settings, &results[i]);
+    }
+    for (int i = 0; i < connections; i++){
+        threads[i].join();
+    }
+    double total_us = elapsed_us(start, clock_type::now());
+
+    std::vector<double> latencies;
+    int errors = 0;
+    for (int i = 0; i < connections; i++){
+        latencies.insert(latencies.end(), results[i].latencies.begin(), results[i].latencies.end());
+        errors += results[i].errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::sort(codec_times.begin(), codec_times.end());
+
+    // overhead compares like percentiles, the daemon's p99 against the codec's own p99
+    double codec_p50 = percentile(codec_times, 0.5);
+    double codec_p99 = percentile(codec_times, 0.99);
+    printf("%s %s: %zu requests over %d connections, window %d, %d errors\n", mode, argv[2], latencies.size(), connections, window, errors);
+    printf("throughput  %.0f requests/s\n", latencies.size() / (total_us / 1e6));
+    printf("latency     p50 %.1f us, p99 %.1f us, max %.1f us\n", percentile(latencies, 0.5), percentile(latencies, 0.99), latencies.empty() ? 0 : latencies.back());
+    printf("codec       p50 %.1f us, p99 %.1f us in process\n", codec_p50, codec_p99);
+    printf("overhead    p50 %.1f us, p99 %.1f us\n", percentile(latencies, 0.5) - codec_p50, percentile(latencies, 0.99) - codec_p99);
+
+    if (settings.image_fd >= 0){
+        close(settings.image_fd);
+    }
+    return errors == 0 ? 0 : 1;
+}